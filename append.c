@@ -25,7 +25,6 @@
  * SUCH DAMAGE.
  */
 
-#include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
 #include <stdbool.h>
@@ -39,14 +38,6 @@
 
 #include "compat.h"
 
-static bool
-ishexstring(const char *s) {
-	for (; *s != '\0'; s++)
-		if (!isxdigit(*s))
-			return false;
-	return true;
-}
-
 int
 tcappend(int argc, char **argv)
 {
@@ -55,10 +46,37 @@ tcappend(int argc, char **argv)
 	const char *errstr = NULL;
 	uint8_t flags = 0;
 	uint16_t category = 0;
+	bool filter = false, paths = false;
+	const char *from = NULL;
+	int delim = '\n', walkflags = 0;
+
+	static struct option longopts[] = {
+		{ "files-from", required_argument, NULL, 'T' },
+		{ "null", no_argument, NULL, '0' },
+		{ NULL, 0, NULL, 0 }
+	};
 
 	int ch;
-	while ((ch = getopt(argc, argv, "u:f:c:")) != -1) {
+	while ((ch = getopt_long(argc, argv, "0FPT:apu:f:c:x", longopts, NULL)) != -1) {
 		switch (ch) {
+			case '0':
+				delim = '\0';
+				break;
+			case 'F':
+				filter = true;
+				break;
+			case 'P':
+				walkflags |= WALK_PHYSICAL;
+				break;
+			case 'T':
+				from = optarg;
+				break;
+			case 'a':
+				walkflags |= WALK_ALL_CDHASHES;
+				break;
+			case 'p':
+				paths = true;
+				break;
 			case 'u':
 				if (strlen(optarg) == 1 && *optarg == '0') {
 					keepuuid = 1;
@@ -83,79 +101,137 @@ tcappend(int argc, char **argv)
 					exit(1);
 				}
 				break;
+			case 'x':
+				walkflags |= WALK_XDEV;
+				break;
 		}
 	}
 
 	argc -= optind;
 	argv += optind;
+	walk_flags(walkflags);
+	walk_reset();
 
-	if (argc < 2)
+	if (argc < (from != NULL ? 1 : 2))
 		return -1;
 
-	FILE *f = NULL;
+	FILE *list = NULL;
+	if (from != NULL && (list = strcmp(from, "-") == 0 ? stdin : fopen(from, "r")) == NULL) {
+		fprintf(stderr, "%s: %s\n", from, strerror(errno));
+		return 1;
+	}
+
 	struct trust_cache cache = opentrustcache(argv[0]);
-	struct trust_cache append = {
+	size_t size = entsize(cache.version);
+
+	// Caches written by this tool are sorted, but one from elsewhere may not be.
+	for (uint32_t i = 1; i < cache.num_entries; i++) {
+		if (ent_cmp((uint8_t *)cache.hashes + size * (i - 1), (uint8_t *)cache.hashes + size * i) > 0) {
+			qsort(cache.hashes, cache.num_entries, size, ent_cmp);
+			break;
+		}
+	}
+
+	// Entries whose cdhash is not in the cache yet, in the cache's version.
+	struct trust_cache added = {
 		.version = cache.version,
 		.num_entries = 0
 	};
+	uint32_t addedcap = 0;
+
+	// Like the filter, an existing provenance sidecar is kept up to date.
+	struct provenance *prov = NULL, *oldprov = NULL;
+	if (provenance_exists(argv[0]) && (oldprov = provenance_open(argv[0], cache.uuid)) == NULL)
+		fprintf(stderr, "%s.paths is out of date, %s\n", argv[0],
+				paths ? "only the new entries will be recorded" : "not updating it");
+	if (paths || oldprov != NULL)
+		prov = provenance_new();
 
-	for (int i = 1; i < argc; i++) {
-		if (strlen(argv[i]) == 40 && ishexstring(argv[i])) {
+	// The file list, if any, is the last input.
+	for (int i = 1; i < argc + (list != NULL); i++) {
+		struct trust_cache append;
+		struct trust_cache_entry2 hex = {};
+		if (i == argc) {
+			append = cache_from_list(list, delim, cache.version, prov);
+		} else if (strlen(argv[i]) == 40 && ishexstring(argv[i])) {
+			// Every version starts with the cdhash, so one entry2 serves for all of them.
+			for (size_t j = 0; j < CS_CDHASH_LEN; j++)
+				sscanf(argv[i] + 2 * j, "%02hhx", &hex.cdhash[j]);
+			append.version = cache.version;
 			append.num_entries = 1;
-			if (append.version == 0) {
-				append.hashes = calloc(1, sizeof(trust_cache_hash0));
-				for (size_t j = 0; j < CS_CDHASH_LEN; j++)
-					sscanf(argv[i] + 2 * j, "%02hhx", &append.hashes[0][j]);
-			} else if (append.version == 1) {
-				append.entries = calloc(1, sizeof(struct trust_cache_entry1));
-				for (size_t j = 0; j < CS_CDHASH_LEN; j++)
-					sscanf(argv[i] + 2 * j, "%02hhx", &append.entries[0].cdhash[j]);
-			} else if (append.version == 2) {
-				append.entries2 = calloc(1, sizeof(struct trust_cache_entry2));
-				for (size_t j = 0; j < CS_CDHASH_LEN; j++)
-					sscanf(argv[i] + 2 * j, "%02hhx", &append.entries2[0].cdhash[j]);
-			}
+			append.entries2 = &hex;
 		} else {
-			append = cache_from_tree(argv[i], cache.version);
+			append = cache_from_tree(argv[i], cache.version, prov);
 		}
-		if (append.version == 0) {
-			if ((cache.hashes = realloc(cache.hashes, sizeof(trust_cache_hash0) *
-							(cache.num_entries + append.num_entries))) == NULL)
-				exit(1);
-			for (uint32_t j = 0; j < append.num_entries; j++) {
-				memcpy(cache.hashes[cache.num_entries + j], append.hashes[j], CS_CDHASH_LEN);
-			}
-		} else if (append.version == 1) {
-			if ((cache.entries = realloc(cache.entries, sizeof(struct trust_cache_entry1) *
-							(cache.num_entries + append.num_entries))) == NULL)
-				exit(1);
-			for (uint32_t j = 0; j < append.num_entries; j++) {
-				cache.entries[cache.num_entries + j].hash_type = append.entries[j].hash_type;
-				cache.entries[cache.num_entries + j].flags = flags != 0 ? flags : append.entries[j].flags;
-				memcpy(cache.entries[cache.num_entries + j].cdhash, append.entries[j].cdhash, CS_CDHASH_LEN);
-			}
-		} else if (append.version == 2) {
-			if ((cache.entries2 = realloc(cache.entries, sizeof(struct trust_cache_entry2) *
-							(cache.num_entries + append.num_entries))) == NULL)
-				exit(1);
-			for (uint32_t j = 0; j < append.num_entries; j++) {
-				cache.entries2[cache.num_entries + j].hash_type = append.entries[j].hash_type;
-				cache.entries2[cache.num_entries + j].flags = flags != 0 ? flags : append.entries[j].flags;
-				cache.entries2[cache.num_entries + j].constraintCategory = category != 0 ? category : append.entries2[j].constraintCategory;
-				cache.entries2[cache.num_entries + j].reserved0 = append.entries2[j].reserved0;
-				memcpy(cache.entries2[cache.num_entries + j].cdhash, append.entries2[j].cdhash, CS_CDHASH_LEN);
+
+		// Most inputs are usually in the cache already, so look each one up before copying it.
+		for (uint32_t j = 0; j < append.num_entries; j++) {
+			const uint8_t *ent = (uint8_t *)append.hashes + size * j;
+			if (cache_search(&cache, NULL, ent) != NULL)
+				continue;
+
+			if (added.num_entries == addedcap) {
+				addedcap = addedcap == 0 ? 64 : addedcap * 2;
+				if ((added.hashes = realloc(added.hashes, size * addedcap)) == NULL)
+					exit(1);
 			}
+			uint8_t *dst = (uint8_t *)added.hashes + size * added.num_entries++;
+			memcpy(dst, ent, size);
+			if (cache.version >= 1 && flags != 0)
+				((struct trust_cache_entry1 *)dst)->flags = flags;
+			if (cache.version == 2 && category != 0)
+				((struct trust_cache_entry2 *)dst)->constraintCategory = category;
 		}
-		free(append.hashes);
-		cache.num_entries += append.num_entries;
+
+		if (append.entries2 != &hex)
+			free(append.hashes);
 	}
+	if (list != NULL && list != stdin)
+		fclose(list);
 
-	if (cache.version == 0)
-		qsort(cache.hashes, cache.num_entries, sizeof(*cache.hashes), hash_cmp);
-	else if (cache.version == 1)
-		qsort(cache.entries, cache.num_entries, sizeof(*cache.entries), ent_cmp);
-	else if (cache.version == 2)
-		qsort(cache.entries, cache.num_entries, sizeof(*cache.entries2), ent_cmp);
+	/*
+	 * With nothing new, the cache and its uuid are left as they are. A
+	 * missing filter is still written for -F, and the paths the inputs were
+	 * found at are still recorded, since they may be new paths to cdhashes
+	 * already in the cache.
+	 */
+	if (added.num_entries == 0 && (keepuuid != 2 || memcmp(uuid, cache.uuid, sizeof(uuid_t)) == 0)) {
+		int ret = 0;
+		struct bloom *b = NULL;
+		if (filter && (b = bloom_open(argv[0], &cache)) == NULL && writebloom(cache, argv[0]) == -1)
+			ret = 1;
+		bloom_free(b);
+		if (oldprov != NULL) {
+			provenance_copy(prov, oldprov, &cache);
+			provenance_free(oldprov);
+		}
+		if (prov != NULL && provenance_write(prov, cache, argv[0]) == -1)
+			ret = 1;
+		provenance_free(prov);
+		free(cache.hashes);
+		return ret;
+	}
+
+	// Merge the sorted new entries into the cache, dropping any found more than once.
+	qsort(added.hashes, added.num_entries, size, ent_cmp);
+	uint8_t *merged = malloc(size * (cache.num_entries + added.num_entries));
+	if (merged == NULL)
+		exit(1);
+	uint8_t *old = (uint8_t *)cache.hashes, *new = (uint8_t *)added.hashes;
+	uint32_t i = 0, j = 0, n = 0;
+	while (i < cache.num_entries || j < added.num_entries) {
+		if (j == added.num_entries || (i < cache.num_entries && ent_cmp(old + size * i, new + size * j) < 0)) {
+			memcpy(merged + size * n++, old + size * i++, size);
+		} else {
+			if (n == 0 || ent_cmp(merged + size * (n - 1), new + size * j) != 0)
+				memcpy(merged + size * n++, new + size * j, size);
+			j++;
+		}
+	}
+	free(cache.hashes);
+	free(added.hashes);
+	cache.hashes = (trust_cache_hash0 *)merged;
+	cache.num_entries = n;
 
 	switch (keepuuid) {
 		case 0:
@@ -168,9 +244,22 @@ tcappend(int argc, char **argv)
 			break;
 	}
 
+	if (oldprov != NULL) {
+		provenance_copy(prov, oldprov, &cache);
+		provenance_free(oldprov);
+	}
+
 	if (writetrustcache(cache, argv[0]) == -1)
 		return 1;
 
+	// An existing filter would miss the new entries, so always rebuild it.
+	if ((filter || bloom_exists(argv[0])) && writebloom(cache, argv[0]) == -1)
+		return 1;
+
+	if (prov != NULL && provenance_write(prov, cache, argv[0]) == -1)
+		return 1;
+
 	free(cache.entries);
+	provenance_free(prov);
 	return 0;
 }
@@ -0,0 +1,551 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Hash the Mach-Os inside zip (and so IPA) archives and tarballs without
+ * extracting them.
+ *
+ * A zip is mapped and walked through its central directory. Stored members
+ * are hashed in place, so only the pages the code signature parser touches
+ * are ever read; deflated members are inflated just far enough to check
+ * their magic, and only Mach-Os are inflated in full. Tarballs, optionally
+ * gzip or (with ZSTD=1) zstd compressed, are read as a stream: the first
+ * block of each member decides whether it is read into memory or skipped.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef ZSTD
+#include <zstd.h>
+#endif
+
+#include "trustcache.h"
+#include "machoparse/cdhash.h"
+#include "machoparse/macho.h"
+
+#define ZIP_LOCAL_SIG		0x04034b50
+#define ZIP_CENTRAL_SIG		0x02014b50
+#define ZIP_END_SIG		0x06054b50
+#define ZIP64_END_SIG		0x06064b50
+#define ZIP64_LOCATOR_SIG	0x07064b50
+#define ZIP64_EXTRA_ID		0x0001
+#define ZIP_END_LEN		22
+#define ZIP_CENTRAL_LEN		46
+#define ZIP_LOCAL_LEN		30
+
+#define TAR_BLOCK		512
+#define ZSTD_MAGIC		0xfd2fb528
+
+// How much of a member is looked at before deciding whether it is a Mach-O.
+#define PEEK_LEN		4096
+// Largest member read into memory; sizes come from the archive and are not trusted.
+#define MEMBER_MAX		((uint64_t)1 << 32)
+// Deflate cannot expand its input by more than this, so a larger claimed size is a lie.
+#define DEFLATE_MAX_RATIO	1032
+
+static uint16_t
+get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+	return (uint32_t)get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static uint64_t
+get64(const uint8_t *p)
+{
+	return (uint64_t)get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+static bool
+is_macho(const uint8_t *p, size_t len)
+{
+	if (len < sizeof(uint32_t))
+		return false;
+	uint32_t magic;
+	memcpy(&magic, p, sizeof(magic));
+	return magic == MH_MAGIC || magic == MH_CIGAM || magic == MH_MAGIC_64 || magic == MH_CIGAM_64 ||
+		magic == FAT_MAGIC || magic == FAT_CIGAM || magic == FAT_MAGIC_64 || magic == FAT_CIGAM_64;
+}
+
+// The cdhashes found are only valid during the call to the sink.
+static void
+hash_member(const char *name, size_t namelen, const uint8_t *data, size_t size, archive_sink cb, void *ctx)
+{
+	struct cdhashes c = {};
+	find_cdhash_mem(data, size, &c);
+	if (c.count == 0)
+		return;
+
+	while (namelen > 2 && name[0] == '.' && name[1] == '/')
+		name += 2, namelen -= 2;
+	char *member = strndup(name, namelen);
+	if (member == NULL)
+		exit(1);
+	cb(member, &c, ctx);
+	free(member);
+}
+
+/*
+ * Inflate a raw deflate stream, stopping after PEEK_LEN bytes if they do not
+ * start a Mach-O. Only then is a buffer of the claimed size allocated.
+ * Returns the inflated member, or NULL if it was skipped or is corrupt.
+ */
+static uint8_t *
+inflate_member(const char *path, const char *name, int namelen, const uint8_t *in, uint64_t inlen, uint64_t outlen)
+{
+	if (outlen < sizeof(uint32_t) || inlen > UINT32_MAX)
+		return NULL;
+
+	uint8_t peek[PEEK_LEN];
+	z_stream zs = {
+		.next_in = (Bytef *)in,
+		.avail_in = inlen,
+		.next_out = peek,
+		.avail_out = outlen < PEEK_LEN ? outlen : PEEK_LEN,
+	};
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+		fprintf(stderr, "%s: Cannot inflate %.*s\n", path, namelen, name);
+		return NULL;
+	}
+
+	uint8_t *out = NULL;
+	int ret = inflate(&zs, Z_SYNC_FLUSH);
+	if ((ret == Z_OK || ret == Z_STREAM_END) && is_macho(peek, zs.total_out)) {
+		if ((out = malloc(outlen)) == NULL) {
+			fprintf(stderr, "%s: %.*s: %s\n", path, namelen, name, strerror(errno));
+			inflateEnd(&zs);
+			return NULL;
+		}
+		memcpy(out, peek, zs.total_out);
+		zs.next_out = out + zs.total_out;
+		// Output is bounded by outlen, so this stays within the buffer.
+		uint64_t remaining = outlen - zs.total_out;
+		while (ret == Z_OK && remaining != 0) {
+			zs.avail_out = remaining > UINT32_MAX ? UINT32_MAX : remaining;
+			ret = inflate(&zs, Z_FINISH);
+			remaining = outlen - zs.total_out;
+		}
+	} else
+		ret = Z_DATA_ERROR;
+	inflateEnd(&zs);
+
+	if ((ret != Z_OK && ret != Z_STREAM_END) || zs.total_out != outlen) {
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+
+static int
+scan_zip(const char *path, const uint8_t *map, size_t size, archive_sink cb, void *ctx)
+{
+	// The end of central directory record is followed by a comment of up to 64k.
+	const uint8_t *end = NULL;
+	for (size_t off = size - ZIP_END_LEN + 1; off-- > 0 && size - off <= ZIP_END_LEN + UINT16_MAX; ) {
+		if (get32(map + off) == ZIP_END_SIG) {
+			end = map + off;
+			break;
+		}
+	}
+	if (end == NULL) {
+		fprintf(stderr, "%s: No zip central directory\n", path);
+		return 0;
+	}
+
+	uint64_t count = get16(end + 10), cdsize = get32(end + 12), cdoff = get32(end + 16);
+	if (count == UINT16_MAX || cdsize == UINT32_MAX || cdoff == UINT32_MAX) {
+		size_t endoff = end - map;
+		if (endoff < 20 || get32(end - 20) != ZIP64_LOCATOR_SIG) {
+			fprintf(stderr, "%s: Missing zip64 end of central directory\n", path);
+			return 0;
+		}
+		uint64_t off64 = get64(end - 20 + 8);
+		if (off64 > size || size - off64 < 56 || get32(map + off64) != ZIP64_END_SIG) {
+			fprintf(stderr, "%s: Bad zip64 end of central directory\n", path);
+			return 0;
+		}
+		count = get64(map + off64 + 32);
+		cdsize = get64(map + off64 + 40);
+		cdoff = get64(map + off64 + 48);
+	}
+	if (cdoff > size || cdsize > size - cdoff) {
+		fprintf(stderr, "%s: Truncated zip central directory\n", path);
+		return 0;
+	}
+
+	const uint8_t *p = map + cdoff, *cdend = p + cdsize;
+	for (uint64_t i = 0; i < count; i++) {
+		if (cdend - p < ZIP_CENTRAL_LEN || get32(p) != ZIP_CENTRAL_SIG) {
+			fprintf(stderr, "%s: Corrupt zip central directory\n", path);
+			return 0;
+		}
+		uint16_t flags = get16(p + 8), method = get16(p + 10);
+		uint64_t csize = get32(p + 20), usize = get32(p + 24);
+		uint16_t namelen = get16(p + 28), extralen = get16(p + 30), commentlen = get16(p + 32);
+		uint64_t localoff = get32(p + 42);
+		const char *name = (const char *)p + ZIP_CENTRAL_LEN;
+		const uint8_t *extra = p + ZIP_CENTRAL_LEN + namelen;
+		if (cdend - p < ZIP_CENTRAL_LEN + namelen + extralen + commentlen) {
+			fprintf(stderr, "%s: Corrupt zip central directory\n", path);
+			return 0;
+		}
+		p += ZIP_CENTRAL_LEN + namelen + extralen + commentlen;
+
+		// Only the fields that overflowed are present in the zip64 extra field, in this order.
+		for (const uint8_t *e = extra; e + 4 <= extra + extralen; e += 4 + get16(e + 2)) {
+			if (get16(e) != ZIP64_EXTRA_ID)
+				continue;
+			const uint8_t *f = e + 4, *fend = f + get16(e + 2);
+			if (fend > extra + extralen)
+				break;
+			if (usize == UINT32_MAX && f + 8 <= fend)
+				usize = get64(f), f += 8;
+			if (csize == UINT32_MAX && f + 8 <= fend)
+				csize = get64(f), f += 8;
+			if (localoff == UINT32_MAX && f + 8 <= fend)
+				localoff = get64(f);
+			break;
+		}
+
+		// Directories, encrypted members and anything too small to be a Mach-O.
+		if ((namelen > 0 && name[namelen - 1] == '/') || (flags & 1) || usize < sizeof(uint32_t))
+			continue;
+
+		if (localoff > size || size - localoff < ZIP_LOCAL_LEN || get32(map + localoff) != ZIP_LOCAL_SIG) {
+			fprintf(stderr, "%s: Bad local header for %.*s\n", path, namelen, name);
+			continue;
+		}
+		uint64_t dataoff = localoff + ZIP_LOCAL_LEN + get16(map + localoff + 26) + get16(map + localoff + 28);
+		if (dataoff > size || csize > size - dataoff) {
+			fprintf(stderr, "%s: Truncated member %.*s\n", path, namelen, name);
+			continue;
+		}
+
+		if (method == 0) {
+			if (is_macho(map + dataoff, csize))
+				hash_member(name, namelen, map + dataoff, csize, cb, ctx);
+		} else if (method == 8) {
+			if (usize > MEMBER_MAX || usize > SIZE_MAX || usize / DEFLATE_MAX_RATIO > csize) {
+				fprintf(stderr, "%s: %.*s claims %llu bytes, skipping it\n", path, namelen, name,
+						(unsigned long long)usize);
+				continue;
+			}
+			uint8_t *data = inflate_member(path, name, namelen, map + dataoff, csize, usize);
+			if (data != NULL)
+				hash_member(name, namelen, data, usize, cb, ctx);
+			free(data);
+		}
+	}
+	return 0;
+}
+
+/*
+ * A tarball, read front to back through whichever decompressor it needs.
+ */
+struct stream {
+	gzFile gz;
+#ifdef ZSTD
+	int fd;
+	ZSTD_DCtx *zd;
+	ZSTD_inBuffer in;
+	uint8_t *inbuf;
+	size_t incap;
+#endif
+};
+
+// Read exactly len bytes, returning false on a short read.
+static bool
+stream_read(struct stream *s, void *buf, size_t len)
+{
+#ifdef ZSTD
+	if (s->zd != NULL) {
+		ZSTD_outBuffer out = { .dst = buf, .size = len, .pos = 0 };
+		while (out.pos < len) {
+			if (s->in.pos == s->in.size) {
+				ssize_t n = read(s->fd, s->inbuf, s->incap);
+				if (n <= 0)
+					return false;
+				s->in.size = n;
+				s->in.pos = 0;
+			}
+			if (ZSTD_isError(ZSTD_decompressStream(s->zd, &out, &s->in)))
+				return false;
+		}
+		return true;
+	}
+#endif
+	while (len > 0) {
+		unsigned chunk = len > INT32_MAX ? INT32_MAX : len;
+		if (gzread(s->gz, buf, chunk) != (int)chunk)
+			return false;
+		buf = (uint8_t *)buf + chunk;
+		len -= chunk;
+	}
+	return true;
+}
+
+static bool
+stream_skip(struct stream *s, uint64_t len)
+{
+#ifdef ZSTD
+	if (s->zd != NULL) {
+		uint8_t buf[16384];
+		while (len > 0) {
+			size_t chunk = len > sizeof(buf) ? sizeof(buf) : len;
+			if (!stream_read(s, buf, chunk))
+				return false;
+			len -= chunk;
+		}
+		return true;
+	}
+#endif
+	// For an uncompressed tarball this is a plain lseek(2).
+	while (len > 0) {
+		z_off_t chunk = len > INT32_MAX ? INT32_MAX : len;
+		if (gzseek(s->gz, chunk, SEEK_CUR) == -1)
+			return false;
+		len -= chunk;
+	}
+	return true;
+}
+
+static bool
+is_tar_header(const uint8_t *block)
+{
+	return memcmp(block + 257, "ustar", 5) == 0;
+}
+
+// Numeric header fields are octal, or big endian base-256 if the top bit is set.
+static uint64_t
+tar_number(const uint8_t *field, size_t len)
+{
+	uint64_t n = 0;
+	if (field[0] & 0x80) {
+		n = field[0] & 0x3f;
+		for (size_t i = 1; i < len; i++)
+			n = n << 8 | field[i];
+		return n;
+	}
+	for (size_t i = 0; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		n = n << 3 | (field[i] - '0');
+	return n;
+}
+
+// Find the path record in a pax extended header.
+static char *
+pax_path(const char *data, size_t len)
+{
+	const char *p = data, *end = data + len;
+	while (p < end) {
+		char *sp;
+		unsigned long reclen = strtoul(p, &sp, 10);
+		if (sp == p || *sp != ' ' || reclen == 0 || reclen > (size_t)(end - p))
+			break;
+		const char *kv = sp + 1, *recend = p + reclen;
+		if (recend - kv > 5 && memcmp(kv, "path=", 5) == 0 && recend[-1] == '\n') {
+			char *path = strndup(kv + 5, recend - kv - 6);
+			if (path == NULL)
+				exit(1);
+			return path;
+		}
+		p = recend;
+	}
+	return NULL;
+}
+
+static int
+scan_tar(const char *path, struct stream *s, const uint8_t *first, archive_sink cb, void *ctx)
+{
+	uint8_t block[TAR_BLOCK];
+	char *longname = NULL;
+	memcpy(block, first, TAR_BLOCK);
+
+	for (;;) {
+		// The archive ends with zeroed blocks.
+		bool zero = true;
+		for (size_t i = 0; i < TAR_BLOCK && zero; i++)
+			zero = block[i] == 0;
+		if (zero || !is_tar_header(block))
+			break;
+
+		uint64_t size = tar_number(block + 124, 12);
+		uint64_t padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+		char type = block[156];
+
+		if (type == 'L' || type == 'x') {
+			// A long name for the next member, GNU or pax style.
+			char *data = size < 1 << 20 ? malloc(padded + 1) : NULL;
+			if (data == NULL || !stream_read(s, data, padded)) {
+				free(data);
+				fprintf(stderr, "%s: Truncated tarball\n", path);
+				break;
+			}
+			data[size] = '\0';
+			free(longname);
+			longname = type == 'L' ? strdup(data) : pax_path(data, size);
+			free(data);
+		} else if ((type == '0' || type == '\0' || type == '7') && size >= sizeof(uint32_t)) {
+			size_t peek = size < TAR_BLOCK ? size : TAR_BLOCK;
+			uint8_t head[TAR_BLOCK], *data = NULL;
+			if (!stream_read(s, head, peek)) {
+				fprintf(stderr, "%s: Truncated tarball\n", path);
+				break;
+			}
+			bool ok = true;
+			if (is_macho(head, peek) && (size > MEMBER_MAX || size > SIZE_MAX || (data = malloc(size)) == NULL)) {
+				fprintf(stderr, "%s: Cannot read a member of %llu bytes, skipping it\n", path,
+						(unsigned long long)size);
+				ok = stream_skip(s, padded - peek);
+			} else if (data != NULL) {
+				memcpy(data, head, peek);
+				ok = stream_read(s, data + peek, size - peek) && stream_skip(s, padded - size);
+				if (ok) {
+					char name[155 + 1 + 100 + 1];
+					if (longname == NULL) {
+						// ustar splits long names into a prefix and a name.
+						snprintf(name, sizeof(name), "%.155s%s%.100s", (char *)block + 345,
+								block[345] != '\0' ? "/" : "", (char *)block);
+					}
+					const char *member = longname != NULL ? longname : name;
+					hash_member(member, strlen(member), data, size, cb, ctx);
+				}
+			} else
+				ok = stream_skip(s, padded - peek);
+			free(data);
+			free(longname);
+			longname = NULL;
+			if (!ok) {
+				fprintf(stderr, "%s: Truncated tarball\n", path);
+				break;
+			}
+		} else {
+			if (!stream_skip(s, padded)) {
+				fprintf(stderr, "%s: Truncated tarball\n", path);
+				break;
+			}
+			if (type != 'g') {
+				free(longname);
+				longname = NULL;
+			}
+		}
+
+		if (!stream_read(s, block, TAR_BLOCK))
+			break;
+	}
+
+	free(longname);
+	return 0;
+}
+
+/*
+ * Hash every Mach-O in the archive at path, calling cb with its name inside
+ * the archive. Returns -1 without reporting anything if path is not an
+ * archive that can be read; problems inside an archive are reported and the
+ * members that could be read are still hashed.
+ */
+int
+scan_archive(const char *path, archive_sink cb, void *ctx)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	uint8_t magic[4];
+	struct stat sb;
+	if (fstat(fd, &sb) == -1 || pread(fd, magic, sizeof(magic), 0) != sizeof(magic)) {
+		close(fd);
+		return -1;
+	}
+
+	// Most files named are Mach-Os, which need no further probing.
+	if (is_macho(magic, sizeof(magic))) {
+		close(fd);
+		return -1;
+	}
+
+	if (get32(magic) == ZIP_LOCAL_SIG || get32(magic) == ZIP_END_SIG) {
+		uint8_t *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED || (size_t)sb.st_size < ZIP_END_LEN) {
+			if (map != MAP_FAILED)
+				munmap(map, sb.st_size);
+			return -1;
+		}
+		int ret = scan_zip(path, map, sb.st_size, cb, ctx);
+		munmap(map, sb.st_size);
+		return ret;
+	}
+
+	struct stream s = {};
+	if (get32(magic) == ZSTD_MAGIC) {
+#ifdef ZSTD
+		s.fd = fd;
+		s.incap = ZSTD_DStreamInSize();
+		if ((s.zd = ZSTD_createDCtx()) == NULL || (s.inbuf = malloc(s.incap)) == NULL)
+			exit(1);
+		s.in.src = s.inbuf;
+#else
+		fprintf(stderr, "%s: zstd support was not built in\n", path);
+		close(fd);
+		return 0;
+#endif
+	} else if ((s.gz = gzdopen(fd, "rb")) == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	// gzip(1) output and plain files both go through zlib, a tar header decides.
+	uint8_t block[TAR_BLOCK];
+	int ret = -1;
+	if (stream_read(&s, block, sizeof(block)) && is_tar_header(block))
+		ret = scan_tar(path, &s, block, cb, ctx);
+
+#ifdef ZSTD
+	if (s.zd != NULL) {
+		ZSTD_freeDCtx(s.zd);
+		free(s.inbuf);
+		close(fd);
+	}
+#endif
+	if (s.gz != NULL)
+		gzclose(s.gz);
+	return ret;
+}
@@ -0,0 +1,236 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure the parse and hash throughput of find_cdhash_batch() on
+ * synthetic signed Mach-Os of each size, on one thread and on one thread
+ * per online CPU. Like a real binary, each has one SHA256 page hash per 4k
+ * page, so the code directory grows with the file. Throughput is counted
+ * over whole files, although only the headers and the code directory are
+ * read.
+ *
+ * usage: cdhash_bench [bytes ...]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trustcache.h"
+#include "machoparse/cdhash.h"
+#include "machoparse/macho.h"
+
+// Files of each size are generated until they add up to this much.
+#define BATCH_BYTES (256ULL * 1024 * 1024)
+#define ROUNDS 16
+
+static uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t
+rng(void)
+{
+	// splitmix64
+	uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+put32be(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+// A 64-bit Mach-O of size bytes whose signature is one code directory at its end.
+static uint8_t *
+macho(size_t size)
+{
+	uint32_t nslots = (size + 4095) / 4096;
+	uint32_t cdlen = 44 + nslots * 32;
+	uint32_t siglen = 20 + cdlen;
+	size_t sigoff = (size - siglen) & ~(size_t)15;
+
+	uint8_t *file = calloc(1, size);
+	if (file == NULL)
+		exit(1);
+
+	struct mach_header_64 mh = {
+		.magic = MH_MAGIC_64,
+		.cputype = 0x0100000c,
+		.filetype = 2,
+		.ncmds = 1,
+		.sizeofcmds = sizeof(struct linkedit_data_command),
+	};
+	struct linkedit_data_command lc = {
+		.cmd = LC_CODE_SIGNATURE,
+		.cmdsize = sizeof(struct linkedit_data_command),
+		.dataoff = sigoff,
+		.datasize = siglen,
+	};
+	memcpy(file, &mh, sizeof(mh));
+	memcpy(file + sizeof(mh), &lc, sizeof(lc));
+
+	uint8_t *sb = file + sigoff;
+	put32be(sb, CSMAGIC_EMBEDDED_SIGNATURE);
+	put32be(sb + 4, siglen);
+	put32be(sb + 8, 1);
+	put32be(sb + 12, CSSLOT_CODEDIRECTORY);
+	put32be(sb + 16, 20);
+
+	uint8_t *cd = sb + 20;
+	put32be(cd, CSMAGIC_CODEDIRECTORY);
+	put32be(cd + 4, cdlen);
+	put32be(cd + 8, 0x20001);
+	put32be(cd + 16, 44);
+	put32be(cd + 28, nslots);
+	put32be(cd + 32, sigoff);
+	cd[36] = 32;
+	cd[37] = CS_HASHTYPE_SHA256;
+	cd[39] = 12;
+	for (uint32_t i = 0; i < nslots * 32; i += 8) {
+		uint64_t r = rng();
+		memcpy(cd + 44 + i, &r, 8);
+	}
+	return file;
+}
+
+struct part {
+	const struct cdhash_buf *bufs;
+	size_t n;
+	struct cdhashes *results;
+	size_t found;
+};
+
+static void *
+run(void *arg)
+{
+	struct part *p = arg;
+	p->found = 0;
+	for (int r = 0; r < ROUNDS; r++)
+		p->found += find_cdhash_batch(p->bufs, p->n, p->results);
+	return NULL;
+}
+
+// Split the batch across nthreads threads and return the time taken in ns.
+static double
+timed(const struct cdhash_buf *bufs, size_t n, struct cdhashes *results, long nthreads)
+{
+	struct part parts[nthreads];
+	pthread_t threads[nthreads];
+	for (long t = 0; t < nthreads; t++) {
+		size_t first = n * t / nthreads, last = n * (t + 1) / nthreads;
+		parts[t] = (struct part){ bufs + first, last - first, results + first, 0 };
+	}
+
+	double start = now();
+	for (long t = 1; t < nthreads; t++)
+		if (pthread_create(&threads[t], NULL, run, &parts[t]) != 0)
+			exit(1);
+	run(&parts[0]);
+	for (long t = 1; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+	double elapsed = now() - start;
+
+	size_t found = 0;
+	for (long t = 0; t < nthreads; t++)
+		found += parts[t].found;
+	if (found != n * ROUNDS) {
+		fprintf(stderr, "hashed %zu of %zu files\n", found, n * ROUNDS);
+		exit(1);
+	}
+	return elapsed;
+}
+
+static void
+bench(size_t size)
+{
+	if (size < 0x4000) {
+		fprintf(stderr, "%zu bytes is too small, the minimum is %d\n", size, 0x4000);
+		exit(1);
+	}
+
+	size_t n = BATCH_BYTES / size;
+	if (n == 0)
+		n = 1;
+	struct cdhash_buf *bufs = calloc(n, sizeof(struct cdhash_buf));
+	struct cdhashes *results = calloc(n, sizeof(struct cdhashes));
+	if (bufs == NULL || results == NULL)
+		exit(1);
+	for (size_t i = 0; i < n; i++) {
+		bufs[i].data = macho(size);
+		bufs[i].size = size;
+	}
+
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+	if (ncpu > (long)n)
+		ncpu = n;
+
+	double mb = (double)size * n * ROUNDS / 1e6;
+	double t1 = timed(bufs, n, results, 1);
+	double tn = timed(bufs, n, results, ncpu);
+
+	printf("%10zu bytes x %6zu: 1 thread %9.1f MB/s, %ld threads %9.1f MB/s (%.0f files/s)\n",
+			size, n, mb / (t1 / 1e9), ncpu, mb / (tn / 1e9), n * ROUNDS / (tn / 1e9));
+
+	for (size_t i = 0; i < n; i++)
+		free((void *)bufs[i].data);
+	free(bufs);
+	free(results);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		bench(64 * 1024);
+		bench(1024 * 1024);
+		bench(16 * 1024 * 1024);
+		return 0;
+	}
+
+	for (int i = 1; i < argc; i++)
+		bench(strtoull(argv[i], NULL, 10));
+	return 0;
+}
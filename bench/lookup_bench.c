@@ -0,0 +1,144 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Compare lookup latency of bsearch(3), interpolation search over the
+ * entries and interpolation search over an index on synthetic caches of
+ * random cdhashes. Half of the queries are hits.
+ *
+ * usage: lookup_bench [entries ...]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trustcache.h"
+
+#define QUERIES 1000000
+
+static uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t
+rng(void)
+{
+	// splitmix64
+	uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void
+randhash(uint8_t *hash)
+{
+	uint64_t r[3] = { rng(), rng(), rng() };
+	memcpy(hash, r, CS_CDHASH_LEN);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+bench(uint32_t n)
+{
+	struct trust_cache cache = {
+		.version = 1,
+		.num_entries = n,
+	};
+	if ((cache.entries = calloc(n, sizeof(struct trust_cache_entry1))) == NULL)
+		exit(1);
+	for (uint32_t i = 0; i < n; i++)
+		randhash(cache.entries[i].cdhash);
+	qsort(cache.entries, n, sizeof(struct trust_cache_entry1), ent_cmp);
+
+	uint8_t (*queries)[CS_CDHASH_LEN] = malloc((size_t)QUERIES * CS_CDHASH_LEN);
+	if (queries == NULL)
+		exit(1);
+	for (uint32_t i = 0; i < QUERIES; i++) {
+		if (i % 2 == 0)
+			memcpy(queries[i], cache.entries[rng() % n].cdhash, CS_CDHASH_LEN);
+		else
+			randhash(queries[i]);
+	}
+
+	double start = now();
+	struct tc_index *idx = index_build(&cache);
+	double build = now() - start;
+
+	uint32_t found[3] = {};
+	double t[3];
+
+	start = now();
+	for (uint32_t i = 0; i < QUERIES; i++)
+		found[0] += bsearch(queries[i], cache.entries, n, sizeof(struct trust_cache_entry1), ent_cmp) != NULL;
+	t[0] = now() - start;
+
+	start = now();
+	for (uint32_t i = 0; i < QUERIES; i++)
+		found[1] += cache_search(&cache, NULL, queries[i]) != NULL;
+	t[1] = now() - start;
+
+	start = now();
+	for (uint32_t i = 0; i < QUERIES; i++)
+		found[2] += cache_search(&cache, idx, queries[i]) != NULL;
+	t[2] = now() - start;
+
+	if (found[0] != found[1] || found[0] != found[2]) {
+		fprintf(stderr, "search results differ: %u %u %u\n", found[0], found[1], found[2]);
+		exit(1);
+	}
+
+	printf("%10u entries: bsearch %6.1f ns, interpolation %6.1f ns, indexed %6.1f ns (index built in %.1f ms)\n",
+			n, t[0] / QUERIES, t[1] / QUERIES, t[2] / QUERIES, build / 1e6);
+
+	index_free(idx);
+	free(queries);
+	free(cache.entries);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		bench(1000000);
+		bench(4000000);
+		bench(16000000);
+		return 0;
+	}
+
+	for (int i = 1; i < argc; i++)
+		bench(strtoul(argv[i], NULL, 10));
+	return 0;
+}
@@ -0,0 +1,274 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Blocked Bloom filter over cdhashes, written beside a cache as
+ * <cache>.bloom so lookups can reject most missing hashes without reading
+ * the entries.
+ *
+ * Each key sets BLOOM_K bits inside a single 512 bit block, so a query
+ * touches one cache line. cdhashes are already uniformly distributed, so
+ * the block and bit positions are taken straight from the hash bytes
+ * instead of being rehashed.
+ *
+ * The header records the number of keys and a checksum of them as well as
+ * the cache's uuid, since append -u 0 rewrites a cache without changing its
+ * uuid, and a reader may open the filter before it is rewritten too. It is
+ * padded to 64 bytes so that every block of the mapped filter starts on a
+ * cache line.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trustcache.h"
+
+#define BLOOM_MAGIC "TCBF"
+#define BLOOM_VERSION 2
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_K 7
+#define BLOOM_K_MAX 16
+#define BLOOM_WORDS 8
+
+struct bloom_header {
+	char magic[4];
+	uint32_t version;
+	uuid_t uuid;
+	uint32_t nblocks;
+	uint32_t k;
+	uint32_t num_entries;
+	uint32_t reserved0;
+	uint64_t checksum;
+	uint8_t reserved[16];
+} __attribute__((__packed__));
+
+struct bloom {
+	uint32_t nblocks;
+	uint32_t k;
+	uint64_t *bits;
+	void *map;
+	size_t maplen;
+};
+
+static char *
+bloom_path(const char *cachepath)
+{
+	size_t len = strlen(cachepath) + sizeof(".bloom");
+	char *path = malloc(len);
+	if (path == NULL)
+		exit(1);
+	snprintf(path, len, "%s.bloom", cachepath);
+	return path;
+}
+
+/*
+ * An order dependent checksum of the cdhashes in cache, so a filter is not
+ * used for a cache holding other keys under the same uuid.
+ */
+static uint64_t
+bloom_checksum(const struct trust_cache *cache)
+{
+	size_t size = entsize(cache->version);
+	uint64_t sum = 0xcbf29ce484222325ULL;
+	for (uint32_t i = 0; i < cache->num_entries; i++) {
+		const uint8_t *hash = (const uint8_t *)cache->hashes + size * i;
+		uint64_t w[3] = { 0 };
+		memcpy(w, hash, CS_CDHASH_LEN);
+		for (int j = 0; j < 3; j++)
+			sum = (sum ^ le64toh(w[j])) * 0x100000001b3ULL;
+	}
+	return sum;
+}
+
+bool
+bloom_exists(const char *cachepath)
+{
+	char *path = bloom_path(cachepath);
+	bool ret = access(path, F_OK) == 0;
+	free(path);
+	return ret;
+}
+
+struct bloom *
+bloom_new(uint64_t n)
+{
+	struct bloom *b = calloc(1, sizeof(struct bloom));
+	if (b == NULL)
+		exit(1);
+
+	uint64_t nblocks = (n * BLOOM_BITS_PER_KEY + BLOOM_WORDS * 64 - 1) / (BLOOM_WORDS * 64);
+	b->nblocks = nblocks == 0 ? 1 : nblocks > UINT32_MAX ? UINT32_MAX : nblocks;
+	b->k = BLOOM_K;
+	if ((b->bits = calloc((size_t)b->nblocks * BLOOM_WORDS, sizeof(uint64_t))) == NULL)
+		exit(1);
+	return b;
+}
+
+void
+bloom_free(struct bloom *b)
+{
+	if (b == NULL)
+		return;
+	if (b->map != NULL)
+		munmap(b->map, b->maplen);
+	else
+		free(b->bits);
+	free(b);
+}
+
+static inline uint64_t *
+bloom_block(const struct bloom *b, const uint8_t hash[CS_CDHASH_LEN], uint32_t *a, uint32_t *d)
+{
+	uint64_t h1, h2;
+	memcpy(&h1, hash, sizeof(h1));
+	memcpy(&h2, hash + sizeof(h1), sizeof(h2));
+	h1 = le64toh(h1);
+	h2 = le64toh(h2);
+
+	*a = (uint32_t)h2;
+	*d = (uint32_t)(h2 >> 32) | 1;
+	return &b->bits[(((h1 >> 32) * b->nblocks) >> 32) * BLOOM_WORDS];
+}
+
+void
+bloom_add(struct bloom *b, const uint8_t hash[CS_CDHASH_LEN])
+{
+	uint32_t a, d;
+	uint64_t *block = bloom_block(b, hash, &a, &d);
+	for (uint32_t i = 0; i < b->k; i++, a += d)
+		block[(a & 511) >> 6] |= htole64(1ULL << (a & 63));
+}
+
+bool
+bloom_test(const struct bloom *b, const uint8_t hash[CS_CDHASH_LEN])
+{
+	uint32_t a, d;
+	const uint64_t *block = bloom_block(b, hash, &a, &d);
+	for (uint32_t i = 0; i < b->k; i++, a += d)
+		if ((block[(a & 511) >> 6] & htole64(1ULL << (a & 63))) == 0)
+			return false;
+	return true;
+}
+
+int
+bloom_write(const struct bloom *b, const struct trust_cache *cache, const char *cachepath)
+{
+	char *path = bloom_path(cachepath);
+	FILE *f = NULL;
+	if ((f = fopen(path, "wb")) == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		free(path);
+		return -1;
+	}
+
+	struct bloom_header hdr = {
+		.magic = BLOOM_MAGIC,
+		.version = htole32(BLOOM_VERSION),
+		.nblocks = htole32(b->nblocks),
+		.k = htole32(b->k),
+		.num_entries = htole32(cache->num_entries),
+		.checksum = htole64(bloom_checksum(cache)),
+	};
+	uuid_copy(hdr.uuid, cache->uuid);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	fwrite(b->bits, sizeof(uint64_t) * BLOOM_WORDS, b->nblocks, f);
+
+	int err = ferror(f);
+	if (fclose(f) != 0 || err) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		free(path);
+		return -1;
+	}
+	free(path);
+	return 0;
+}
+
+int
+writebloom(struct trust_cache cache, const char *cachepath)
+{
+	size_t size = entsize(cache.version);
+	struct bloom *b = bloom_new(cache.num_entries);
+	for (uint32_t i = 0; i < cache.num_entries; i++)
+		bloom_add(b, (uint8_t *)cache.hashes + size * i);
+	int ret = bloom_write(b, &cache, cachepath);
+	bloom_free(b);
+	return ret;
+}
+
+/*
+ * Map the filter for cache, read from cachepath. A missing, malformed or
+ * stale filter (one written for a different uuid or other keys) is not an
+ * error, the caller just has to search the cache.
+ */
+struct bloom *
+bloom_open(const char *cachepath, const struct trust_cache *cache)
+{
+	char *path = bloom_path(cachepath);
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1)
+		return NULL;
+
+	struct stat sb;
+	struct bloom_header *hdr;
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(*hdr) ||
+			(hdr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	uint32_t nblocks = le32toh(hdr->nblocks), k = le32toh(hdr->k);
+	if (memcmp(hdr->magic, BLOOM_MAGIC, sizeof(hdr->magic)) != 0 ||
+			le32toh(hdr->version) != BLOOM_VERSION || nblocks == 0 ||
+			k == 0 || k > BLOOM_K_MAX ||
+			sizeof(*hdr) + (uint64_t)nblocks * BLOOM_WORDS * sizeof(uint64_t) != (uint64_t)sb.st_size ||
+			memcmp(hdr->uuid, cache->uuid, sizeof(uuid_t)) != 0 ||
+			le32toh(hdr->num_entries) != cache->num_entries ||
+			le64toh(hdr->checksum) != bloom_checksum(cache)) {
+		munmap(hdr, sb.st_size);
+		return NULL;
+	}
+
+	struct bloom *b = calloc(1, sizeof(struct bloom));
+	if (b == NULL)
+		exit(1);
+	b->nblocks = nblocks;
+	b->k = k;
+	b->bits = (uint64_t *)(hdr + 1);
+	b->map = hdr;
+	b->maplen = sb.st_size;
+	return b;
+}
@@ -0,0 +1,221 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trustcache.h"
+
+// Entries are read this many at a time, so a lying header cannot make us allocate more than the file holds.
+#define LOAD_CHUNK 4096
+
+/*
+ * Read a trustcache from f, path only being used in messages. Returns -1
+ * after printing why if it is not a complete cache of a supported version.
+ */
+int
+loadtrustcache(FILE *f, const char *path, struct trust_cache *cache)
+{
+	const size_t hdrsize = sizeof(struct trust_cache) - sizeof(struct trust_cache_entry1*);
+
+	if (fread(cache, hdrsize, 1, f) != 1) {
+		fprintf(stderr, "%s: Truncated trustcache header\n", path);
+		return -1;
+	}
+	cache->version = le32toh(cache->version);
+	cache->num_entries = le32toh(cache->num_entries);
+	cache->hashes = NULL;
+
+	size_t size = entsize(cache->version);
+	if (size == 0) {
+		fprintf(stderr, "%s: Unsupported version %i\n", path, cache->version);
+		return -1;
+	}
+
+	uint8_t *entries = NULL;
+	uint32_t done = 0, cap = 0;
+	while (done < cache->num_entries) {
+		if (done == cap) {
+			// Double the buffer, but never past what the header claims.
+			if (cap < LOAD_CHUNK)
+				cap = LOAD_CHUNK;
+			else
+				cap = cap > cache->num_entries / 2 ? cache->num_entries : cap * 2;
+			if (cap > cache->num_entries)
+				cap = cache->num_entries;
+			if ((entries = realloc(entries, size * cap)) == NULL)
+				exit(1);
+		}
+		size_t got = fread(entries + size * done, size, cap - done, f);
+		done += got;
+		if (got == 0)
+			break;
+	}
+
+	if (done != cache->num_entries) {
+		fprintf(stderr, "%s: Truncated trustcache, expected %u entries but found %u\n",
+				path, cache->num_entries, done);
+		free(entries);
+		return -1;
+	}
+
+	cache->hashes = (trust_cache_hash0 *)entries;
+	return 0;
+}
+
+struct trust_cache
+opentrustcache(const char *path)
+{
+	FILE *f;
+	struct trust_cache cache;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	if (loadtrustcache(f, path, &cache) == -1)
+		exit(1);
+
+	fclose(f);
+	return cache;
+}
+
+/*
+ * Map a cache, read-only and private unless writable, in which case stores to
+ * its entries go straight to the file.
+ */
+static int
+map(const char *path, struct mapped_cache *m, bool writable)
+{
+	const size_t hdrsize = sizeof(struct trust_cache) - sizeof(struct trust_cache_entry1*);
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(path, writable ? O_RDWR : O_RDONLY)) == -1 || fstat(fd, &sb) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	if ((size_t)sb.st_size < hdrsize) {
+		fprintf(stderr, "%s: Truncated trustcache header\n", path);
+		close(fd);
+		return -1;
+	}
+
+	m->maplen = sb.st_size;
+	m->map = mmap(NULL, m->maplen, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+			writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m->map == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	memcpy(&m->cache, m->map, hdrsize);
+	m->cache.version = le32toh(m->cache.version);
+	m->cache.num_entries = le32toh(m->cache.num_entries);
+	m->cache.hashes = (trust_cache_hash0 *)((uint8_t *)m->map + hdrsize);
+
+	size_t size = entsize(m->cache.version);
+	if (size == 0) {
+		fprintf(stderr, "%s: Unsupported version %i\n", path, m->cache.version);
+		goto fail;
+	}
+	if ((m->maplen - hdrsize) / size < m->cache.num_entries) {
+		fprintf(stderr, "%s: Truncated trustcache, expected %u entries\n", path, m->cache.num_entries);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	munmap(m->map, m->maplen);
+	m->map = NULL;
+	return -1;
+}
+
+int
+mapcache(const char *path, struct mapped_cache *m)
+{
+	return map(path, m, false);
+}
+
+int
+mapcache_writable(const char *path, struct mapped_cache *m)
+{
+	return map(path, m, true);
+}
+
+void
+unmapcache(struct mapped_cache *m)
+{
+	if (m->map != NULL)
+		munmap(m->map, m->maplen);
+	m->map = NULL;
+}
+
+int
+writetrustcache(struct trust_cache cache, const char *path)
+{
+	FILE *f = NULL;
+	if ((f = fopen(path, "wb")) == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	bool err = false;
+	cache.version = htole32(cache.version);
+	cache.num_entries = htole32(cache.num_entries);
+	if (fwrite(&cache, sizeof(struct trust_cache) - sizeof(struct trust_cache_entry1*), 1, f) != 1)
+		err = true;
+	cache.version = le32toh(cache.version);
+	cache.num_entries = le32toh(cache.num_entries);
+
+	for (uint32_t i = 0; i < cache.num_entries && !err; i++) {
+		if (cache.version == 0)
+			err = fwrite(&cache.hashes[i], sizeof(trust_cache_hash0), 1, f) != 1;
+		else if (cache.version == 1)
+			err = fwrite(&cache.entries[i], sizeof(struct trust_cache_entry1), 1, f) != 1;
+		else if (cache.version == 2)
+			err = fwrite(&cache.entries2[i], sizeof(struct trust_cache_entry2), 1, f) != 1;
+	}
+
+	if (fclose(f) != 0 || err) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
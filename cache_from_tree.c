@@ -25,79 +25,780 @@
  * SUCH DAMAGE.
  */
 
-#define _XOPEN_SOURCE 500
+#include <dirent.h>
 #include <errno.h>
-#include <ftw.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "trustcache.h"
 #include "machoparse/cdhash.h"
 
 static struct trust_cache cache = {};
+static uint32_t cap = 0;
+
+static tree_sink sink = NULL;
+static void *sinkctx = NULL;
+
+static int jobs = 0;
+static int flags = 0;
+
+/*
+ * Files named directly, or listed with walk_list(), are hashed WALK_BATCH at
+ * a time by up to walk_jobs threads, then handed to the sink in the order
+ * they were given, so the output does not depend on which thread finished
+ * first.
+ */
+#define WALK_BATCH 1024
+
+// Only the cdhashes found are kept, archives can hold many members.
+struct member {
+	char *name;
+	int count;
+	struct hashes *h;
+};
+
+/*
+ * A file named on the command line may be an archive, whose members are
+ * reported as if the archive were a directory.
+ */
+struct found_file {
+	char *path;
+	struct stat sb;
+	bool hassb;
+	struct seen_file *seen;
+	struct cdhashes c;
+	struct member *members;
+	size_t nmembers;
+};
+
+static struct {
+	struct found_file files[WALK_BATCH];
+	size_t count;
+	atomic_size_t next;
+} batch = {};
+
+/*
+ * Directories are walked by up to walk_jobs threads sharing a stack of
+ * directories still to be read and one of files still to be hashed. A
+ * thread reading a directory stats nothing d_type already rules out, and
+ * pushes its subdirectories and its regular files, DIR_BATCH at a time,
+ * for any thread to take. Files are opened with openat(2) relative to
+ * their directory, which stays open until its last batch is hashed.
+ * Threads take files before directories, so only the directories whose
+ * files are still waiting are held open. Only calls to the sink are
+ * serialized.
+ */
+#define DIR_BATCH 64
+
+struct dir {
+	char *path;
+	dev_t rootdev;
+};
+
+// A directory whose files are being hashed, freed with its last batch.
+struct dirref {
+	int fd;
+	char *path;
+	size_t refs;
+};
+
+struct filebatch {
+	struct dirref *dir;
+	size_t count;
+	struct {
+		char *name;
+		// reached through a symlink
+		bool link;
+	} files[DIR_BATCH];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct dir *stack;
+	size_t count, cap;
+	struct filebatch **batches;
+	size_t nbatches, batchcap;
+	// Directories and batches pushed but not yet finished; the walk is over at zero.
+	size_t pending;
+} dirs = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_mutex_t sinklock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Every (st_dev, st_ino) hashed that another path could reach, so hard
+ * links and the targets of symlinks are only opened and hashed the first
+ * time, and every directory walked, so symlinks cannot lead the walk in
+ * circles and overlapping inputs are read once. Open addressing with linear
+ * probing; ino 0 marks an empty slot. Both are emptied by walk_reset(), once
+ * per command, so they cover all of its walks.
+ */
+struct inode {
+	dev_t dev;
+	ino_t ino;
+	struct seen_file *file;
+};
+
+/*
+ * What hashing a file found, so every other path to it is reported to the
+ * sink with the same cdhashes. Paths reaching it while another thread is
+ * still hashing it wait here and are reported by that thread.
+ */
+struct seen_file {
+	bool done;
+	int count;
+	struct hashes *h;
+	char **waiting;
+	size_t nwaiting;
+};
+
+struct inode_set {
+	struct inode *slots;
+	size_t cap;
+	size_t count;
+	pthread_mutex_t lock;
+};
+
+static struct inode_set seen = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct inode_set walked = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t
+inode_slot(struct inode *slots, size_t cap, dev_t dev, ino_t ino)
+{
+	size_t i = (size_t)(((uint64_t)ino ^ ((uint64_t)dev << 32)) * 0x9e3779b97f4a7c15ULL >> 16) & (cap - 1);
+	while (slots[i].ino != 0 && (slots[i].ino != ino || slots[i].dev != dev))
+		i = (i + 1) & (cap - 1);
+	return i;
+}
+
+// Find or add an inode, with set->lock held. The slot moves when the set grows.
+static struct inode *
+inode_add_locked(struct inode_set *set, dev_t dev, ino_t ino, bool *added)
+{
+	if (set->count * 2 >= set->cap) {
+		size_t cap = set->cap == 0 ? 1024 : set->cap * 2;
+		struct inode *slots = calloc(cap, sizeof(struct inode));
+		if (slots == NULL)
+			exit(1);
+		for (size_t i = 0; i < set->cap; i++)
+			if (set->slots[i].ino != 0)
+				slots[inode_slot(slots, cap, set->slots[i].dev, set->slots[i].ino)] = set->slots[i];
+		free(set->slots);
+		set->slots = slots;
+		set->cap = cap;
+	}
+
+	size_t i = inode_slot(set->slots, set->cap, dev, ino);
+	*added = set->slots[i].ino == 0;
+	if (*added) {
+		set->slots[i].dev = dev;
+		set->slots[i].ino = ino;
+		set->slots[i].file = NULL;
+		set->count++;
+	}
+	return &set->slots[i];
+}
+
+// Record an inode, returning false if it was already recorded.
+static bool
+inode_insert(struct inode_set *set, dev_t dev, ino_t ino)
+{
+	if (ino == 0)
+		return true;
+
+	bool added;
+	pthread_mutex_lock(&set->lock);
+	inode_add_locked(set, dev, ino, &added);
+	pthread_mutex_unlock(&set->lock);
+	return added;
+}
+
+static void
+inode_reset(struct inode_set *set)
+{
+	for (size_t i = 0; i < set->cap; i++) {
+		struct seen_file *f = set->slots[i].file;
+		if (f == NULL)
+			continue;
+		for (size_t j = 0; j < f->nwaiting; j++)
+			free(f->waiting[j]);
+		free(f->waiting);
+		free(f->h);
+		free(f);
+	}
+	free(set->slots);
+	set->slots = NULL;
+	set->cap = set->count = 0;
+}
+
+/*
+ * The record of a regular file, and whether this is the first path to it,
+ * whose caller must hash it and pass the result to seen_finish(). Only
+ * files with more than one link, or reached through a symlink, are
+ * recorded; NULL for any other, which is always hashed. A file with one
+ * link that is reached both directly and through a symlink may be hashed
+ * twice, and its cdhashes reported twice, which callers already drop.
+ */
+static struct seen_file *
+seen_get(const struct stat *sb, bool link, bool *first)
+{
+	*first = true;
+	if (sb->st_ino == 0 || (sb->st_nlink <= 1 && !link))
+		return NULL;
+
+	pthread_mutex_lock(&seen.lock);
+	struct inode *slot = inode_add_locked(&seen, sb->st_dev, sb->st_ino, first);
+	if (*first && (slot->file = calloc(1, sizeof(struct seen_file))) == NULL)
+		exit(1);
+	struct seen_file *f = slot->file;
+	pthread_mutex_unlock(&seen.lock);
+	return f;
+}
+
+static void
+emit(const char *path, const struct hashes *h, int count, bool repeat)
+{
+	for (int j = 0; j < count; j++) {
+		struct trust_cache_entry2 ent = {
+			.hash_type = h[j].hash_type,
+		};
+		struct tree_origin origin = {
+			.path = path,
+			.cputype = h[j].cputype,
+			.cpusubtype = h[j].cpusubtype,
+			.repeat = repeat,
+		};
+		memcpy(ent.cdhash, h[j].cdhash, CS_CDHASH_LEN);
+		sink(&ent, &origin, sinkctx);
+	}
+}
+
+// Report another path to a file, now or, if it is still being hashed, once it is.
+static void
+seen_repeat(struct seen_file *f, const char *path)
+{
+	pthread_mutex_lock(&seen.lock);
+	if (!f->done) {
+		if ((f->waiting = realloc(f->waiting, sizeof(char *) * (f->nwaiting + 1))) == NULL ||
+				(f->waiting[f->nwaiting++] = strdup(path)) == NULL)
+			exit(1);
+		pthread_mutex_unlock(&seen.lock);
+		return;
+	}
+	pthread_mutex_unlock(&seen.lock);
+
+	// A finished record is never written again, so it is read unlocked.
+	if (f->count != 0) {
+		pthread_mutex_lock(&sinklock);
+		emit(path, f->h, f->count, true);
+		pthread_mutex_unlock(&sinklock);
+	}
+}
+
+// Keep what hashing a file found, then report the paths that reached it meanwhile.
+static void
+seen_finish(struct seen_file *f, const struct cdhashes *c)
+{
+	if (f == NULL)
+		return;
+
+	pthread_mutex_lock(&seen.lock);
+	f->count = c->count;
+	if (c->count != 0) {
+		if ((f->h = malloc(sizeof(struct hashes) * c->count)) == NULL)
+			exit(1);
+		memcpy(f->h, c->h, sizeof(struct hashes) * c->count);
+	}
+	f->done = true;
+	char **waiting = f->waiting;
+	size_t nwaiting = f->nwaiting;
+	f->waiting = NULL;
+	f->nwaiting = 0;
+	pthread_mutex_unlock(&seen.lock);
+
+	for (size_t i = 0; i < nwaiting; i++) {
+		if (f->count != 0) {
+			pthread_mutex_lock(&sinklock);
+			emit(waiting[i], f->h, f->count, true);
+			pthread_mutex_unlock(&sinklock);
+		}
+		free(waiting[i]);
+	}
+	free(waiting);
+}
 
 static int
-tccallback(const char *path, const struct stat *sb, __attribute__((unused)) int typeflag, __attribute__((unused)) struct FTW *ftw)
+thread_count(size_t work)
 {
-	if (!S_ISREG(sb->st_mode))
-		return 0;
+	long n = jobs > 0 ? jobs : sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > (long)work)
+		n = work;
+	return n < 1 ? 1 : n;
+}
 
-	struct cdhashes c = {};
-	c.count = 0;
-	find_cdhash(path, sb, &c);
+// Run fn on n threads, the calling thread being one of them.
+static void
+run_threads(int n, void *(*fn)(void *))
+{
+	pthread_t threads[n > 1 ? n - 1 : 1];
+	int started = 0;
+	for (; started < n - 1; started++)
+		if (pthread_create(&threads[started], NULL, fn, NULL) != 0)
+			break;
+	fn(NULL);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
 
-	if (c.count == 0)
-		return 0;
+static void
+add_member(const char *name, struct cdhashes *c, void *ctx)
+{
+	struct found_file *f = ctx;
+	if ((f->members = realloc(f->members, (f->nmembers + 1) * sizeof(struct member))) == NULL)
+		exit(1);
+	struct member *m = &f->members[f->nmembers++];
+	if ((m->name = strdup(name)) == NULL || (m->h = malloc(c->count * sizeof(struct hashes))) == NULL)
+		exit(1);
+	memcpy(m->h, c->h, c->count * sizeof(struct hashes));
+	m->count = c->count;
+}
 
-	for (int i = 0; i < c.count; i++) {
-		if (cache.version == 0) {
-			if ((cache.hashes = realloc(cache.hashes, sizeof(trust_cache_hash0) * (cache.num_entries + 1))) == NULL)
-				exit(1);
-			memcpy(cache.hashes[cache.num_entries], c.h[i].cdhash, CS_CDHASH_LEN);
-		} else if (cache.version == 1) {
-			if ((cache.entries = realloc(cache.entries, sizeof(struct trust_cache_entry1) * (cache.num_entries + 1))) == NULL)
+static void *
+hash_worker(__attribute__((unused)) void *arg)
+{
+	size_t i;
+	while ((i = atomic_fetch_add(&batch.next, 1)) < batch.count) {
+		struct found_file *f = &batch.files[i];
+		find_cdhash(f->path, f->hassb ? &f->sb : NULL, &f->c);
+		if (f->c.count == 0)
+			scan_archive(f->path, add_member, f);
+	}
+	return NULL;
+}
+
+static void
+flush_batch(void)
+{
+	atomic_store(&batch.next, 0);
+	run_threads(thread_count(batch.count), hash_worker);
+
+	for (size_t i = 0; i < batch.count; i++) {
+		struct found_file *f = &batch.files[i];
+		seen_finish(f->seen, &f->c);
+		emit(f->path, f->c.h, f->c.count, false);
+
+		for (size_t j = 0; j < f->nmembers; j++) {
+			size_t len = strlen(f->path) + strlen(f->members[j].name) + 2;
+			char *path = malloc(len);
+			if (path == NULL)
 				exit(1);
-			cache.entries[cache.num_entries].hash_type = c.h[i].hash_type;
-			cache.entries[cache.num_entries].flags = 0;
-			memcpy(cache.entries[cache.num_entries].cdhash, c.h[i].cdhash, CS_CDHASH_LEN);
-		} else if (cache.version == 2) {
-			if ((cache.entries2 = realloc(cache.entries, sizeof(struct trust_cache_entry2) * (cache.num_entries + 1))) == NULL)
+			snprintf(path, len, "%s/%s", f->path, f->members[j].name);
+			emit(path, f->members[j].h, f->members[j].count, false);
+			free(path);
+			free(f->members[j].name);
+			free(f->members[j].h);
+		}
+		free(f->members);
+		free(f->path);
+	}
+	batch.count = 0;
+}
+
+static void
+batch_add(const char *path, const struct stat *sb, struct seen_file *seen)
+{
+	struct found_file *f = &batch.files[batch.count++];
+	if ((f->path = strdup(path)) == NULL)
+		exit(1);
+	if (sb != NULL)
+		f->sb = *sb;
+	f->hassb = sb != NULL;
+	f->seen = seen;
+	f->c.count = 0;
+	f->members = NULL;
+	f->nmembers = 0;
+
+	if (batch.count == WALK_BATCH)
+		flush_batch();
+}
+
+// Hash with at most n threads, or one per online CPU if n is 0.
+void
+walk_jobs(int n)
+{
+	jobs = n;
+}
+
+/*
+ * Forget the files and directories earlier walks reached. Called once per
+ * command, so a file reached again by a later walk of the same command is
+ * reported as a repeat and a directory already read is not read again.
+ */
+void
+walk_reset(void)
+{
+	inode_reset(&seen);
+	inode_reset(&walked);
+}
+
+// WALK_PHYSICAL, WALK_XDEV and WALK_ALL_CDHASHES, see trustcache.h.
+void
+walk_flags(int f)
+{
+	flags = f;
+	cdhash_all(f & WALK_ALL_CDHASHES);
+}
+
+static char *
+join_path(const char *dir, const char *name)
+{
+	size_t dirlen = strlen(dir);
+	while (dirlen > 1 && dir[dirlen - 1] == '/')
+		dirlen--;
+	size_t len = dirlen + strlen(name) + 2;
+	char *path = malloc(len);
+	if (path == NULL)
+		exit(1);
+	snprintf(path, len, "%.*s/%s", (int)dirlen, dir, name);
+	return path;
+}
+
+static void
+push_dir(char *path, dev_t rootdev)
+{
+	pthread_mutex_lock(&dirs.lock);
+	if (dirs.count == dirs.cap) {
+		dirs.cap = dirs.cap == 0 ? 64 : dirs.cap * 2;
+		if ((dirs.stack = realloc(dirs.stack, dirs.cap * sizeof(struct dir))) == NULL)
+			exit(1);
+	}
+	dirs.stack[dirs.count].path = path;
+	dirs.stack[dirs.count].rootdev = rootdev;
+	dirs.count++;
+	dirs.pending++;
+	pthread_cond_signal(&dirs.cond);
+	pthread_mutex_unlock(&dirs.lock);
+}
+
+// Hash a regular file in a directory that was read, unless its inode was seen.
+static void
+hash_at(int dfd, const char *dirpath, const char *name, bool link)
+{
+	int fd = openat(dfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	struct stat sb;
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+		close(fd);
+		return;
+	}
+
+	bool first;
+	struct seen_file *f = seen_get(&sb, link, &first);
+	if (!first) {
+		close(fd);
+		char *path = join_path(dirpath, name);
+		seen_repeat(f, path);
+		free(path);
+		return;
+	}
+
+	struct cdhashes c = {};
+	find_cdhash_fd(fd, &sb, &c);
+	close(fd);
+	seen_finish(f, &c);
+
+	if (c.count != 0) {
+		char *path = join_path(dirpath, name);
+		pthread_mutex_lock(&sinklock);
+		emit(path, c.h, c.count, false);
+		pthread_mutex_unlock(&sinklock);
+		free(path);
+	}
+}
+
+static void
+push_batch(struct filebatch *b)
+{
+	pthread_mutex_lock(&dirs.lock);
+	if (dirs.nbatches == dirs.batchcap) {
+		dirs.batchcap = dirs.batchcap == 0 ? 64 : dirs.batchcap * 2;
+		if ((dirs.batches = realloc(dirs.batches, dirs.batchcap * sizeof(*dirs.batches))) == NULL)
+			exit(1);
+	}
+	dirs.batches[dirs.nbatches++] = b;
+	b->dir->refs++;
+	dirs.pending++;
+	pthread_cond_signal(&dirs.cond);
+	pthread_mutex_unlock(&dirs.lock);
+}
+
+static void
+dir_release(struct dirref *ref)
+{
+	pthread_mutex_lock(&dirs.lock);
+	bool last = --ref->refs == 0;
+	pthread_mutex_unlock(&dirs.lock);
+	if (last) {
+		close(ref->fd);
+		free(ref->path);
+		free(ref);
+	}
+}
+
+static void
+hash_batch(struct filebatch *b)
+{
+	for (size_t i = 0; i < b->count; i++) {
+		hash_at(b->dir->fd, b->dir->path, b->files[i].name, b->files[i].link);
+		free(b->files[i].name);
+	}
+	dir_release(b->dir);
+	free(b);
+}
+
+static void
+read_dir(struct dir *d)
+{
+	int dfd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct stat sb;
+	if (dfd == -1 || fstat(dfd, &sb) == -1) {
+		fprintf(stderr, "%s: %s\n", d->path, strerror(errno));
+		if (dfd != -1)
+			close(dfd);
+		return;
+	}
+
+	// A directory reached twice, through a symlink or overlapping inputs, is read once.
+	if (((flags & WALK_XDEV) && sb.st_dev != d->rootdev) || !inode_insert(&walked, sb.st_dev, sb.st_ino)) {
+		close(dfd);
+		return;
+	}
+
+	DIR *dp = fdopendir(dfd);
+	if (dp == NULL) {
+		fprintf(stderr, "%s: %s\n", d->path, strerror(errno));
+		close(dfd);
+		return;
+	}
+
+	// The files are hashed through a descriptor of their own, dp's goes with it.
+	struct dirref *ref = calloc(1, sizeof(*ref));
+	if (ref == NULL || (ref->path = strdup(d->path)) == NULL)
+		exit(1);
+	ref->refs = 1;
+	if ((ref->fd = dup(dfd)) == -1) {
+		fprintf(stderr, "%s: %s\n", d->path, strerror(errno));
+		free(ref->path);
+		free(ref);
+		closedir(dp);
+		return;
+	}
+
+	struct filebatch *b = NULL;
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		unsigned char type = de->d_type;
+		if (type == DT_LNK && (flags & WALK_PHYSICAL))
+			continue;
+		bool link = type == DT_LNK;
+		// Only symlinks being followed and filesystems without d_type need a stat.
+		if (type == DT_LNK || type == DT_UNKNOWN) {
+			struct stat lsb;
+			if (fstatat(dfd, de->d_name, &lsb, link ? 0 : AT_SYMLINK_NOFOLLOW) == -1)
+				continue;
+			// Without d_type, a symlink is only known as one now.
+			if (S_ISLNK(lsb.st_mode)) {
+				if ((flags & WALK_PHYSICAL) || fstatat(dfd, de->d_name, &lsb, 0) == -1)
+					continue;
+				link = true;
+			}
+			type = S_ISREG(lsb.st_mode) ? DT_REG : S_ISDIR(lsb.st_mode) ? DT_DIR : DT_UNKNOWN;
+		}
+
+		if (type == DT_REG) {
+			if (b == NULL) {
+				if ((b = malloc(sizeof(*b))) == NULL)
+					exit(1);
+				b->dir = ref;
+				b->count = 0;
+			}
+			if ((b->files[b->count].name = strdup(de->d_name)) == NULL)
 				exit(1);
-			cache.entries2[cache.num_entries].hash_type = c.h[i].hash_type;
-			cache.entries2[cache.num_entries].constraintCategory = 0;
-			cache.entries2[cache.num_entries].reserved0 = 0;
-			memcpy(cache.entries2[cache.num_entries].cdhash, c.h[i].cdhash, CS_CDHASH_LEN);
+			b->files[b->count++].link = link;
+			if (b->count == DIR_BATCH) {
+				push_batch(b);
+				b = NULL;
+			}
+		} else if (type == DT_DIR)
+			push_dir(join_path(d->path, de->d_name), d->rootdev);
+	}
+	if (b != NULL)
+		push_batch(b);
+	closedir(dp);
+	dir_release(ref);
+}
+
+static void *
+dir_worker(__attribute__((unused)) void *arg)
+{
+	pthread_mutex_lock(&dirs.lock);
+	for (;;) {
+		while (dirs.count == 0 && dirs.nbatches == 0 && dirs.pending != 0)
+			pthread_cond_wait(&dirs.cond, &dirs.lock);
+		if (dirs.pending == 0)
+			break;
+
+		if (dirs.nbatches != 0) {
+			struct filebatch *b = dirs.batches[--dirs.nbatches];
+			pthread_mutex_unlock(&dirs.lock);
+			hash_batch(b);
+		} else {
+			struct dir d = dirs.stack[--dirs.count];
+			pthread_mutex_unlock(&dirs.lock);
+			read_dir(&d);
+			free(d.path);
 		}
-		cache.num_entries++;
+		pthread_mutex_lock(&dirs.lock);
+
+		if (--dirs.pending == 0)
+			pthread_cond_broadcast(&dirs.cond);
+	}
+	pthread_mutex_unlock(&dirs.lock);
+	return NULL;
+}
+
+/*
+ * Hash every regular file at or below path. path itself is always
+ * followed if it is a symlink; see walk_flags() for the ones below it.
+ */
+int
+walk_tree(const char *path, tree_sink cb, void *ctx)
+{
+	sink = cb;
+	sinkctx = ctx;
+
+	struct stat sb, lsb;
+	if (stat(path, &sb) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
 	}
 
-	free(c.h);
+	if (S_ISREG(sb.st_mode)) {
+		bool first;
+		bool link = lstat(path, &lsb) == 0 && S_ISLNK(lsb.st_mode);
+		struct seen_file *f = seen_get(&sb, link, &first);
+		if (first)
+			batch_add(path, &sb, f);
+		else
+			seen_repeat(f, path);
+		flush_batch();
+	} else if (S_ISDIR(sb.st_mode)) {
+		char *root = strdup(path);
+		if (root == NULL)
+			exit(1);
+		push_dir(root, sb.st_dev);
+		run_threads(thread_count(SIZE_MAX), dir_worker);
+	}
 
 	return 0;
 }
 
-struct trust_cache
-cache_from_tree(const char *path, uint32_t version)
+/*
+ * Hash each file named in list, one per line or, if delim is '\0', NUL
+ * separated. Nothing is walked or stat'd, so every name is hashed as given
+ * and each is treated as if it were named on the command line.
+ */
+int
+walk_list(FILE *list, int delim, tree_sink cb, void *ctx)
+{
+	sink = cb;
+	sinkctx = ctx;
+
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t len;
+	while ((len = getdelim(&line, &linecap, delim, list)) != -1) {
+		if (len > 0 && line[len - 1] == delim)
+			line[--len] = '\0';
+		if (len != 0)
+			batch_add(line, NULL, NULL);
+	}
+	free(line);
+	flush_batch();
+
+	if (ferror(list)) {
+		perror("read");
+		return -1;
+	}
+	return 0;
+}
+
+static void
+cache_add(const struct trust_cache_entry2 *ent, const struct tree_origin *origin, void *ctx)
+{
+	if (ctx != NULL)
+		provenance_add(ctx, ent, origin);
+	if (origin->repeat)
+		return;
+
+	size_t size = entsize(cache.version);
+
+	if (cache.num_entries == cap) {
+		cap = cap == 0 ? 64 : cap * 2;
+		if ((cache.hashes = realloc(cache.hashes, size * cap)) == NULL)
+			exit(1);
+	}
+	memcpy((uint8_t *)cache.hashes + size * cache.num_entries, ent, size);
+	cache.num_entries++;
+}
+
+/*
+ * Hash every file under path, or every file named in list if path is NULL.
+ * If prov is not NULL, the origin of each cdhash is recorded in it as well.
+ */
+static struct trust_cache
+collect(const char *path, FILE *list, int delim, uint32_t version, struct provenance *prov)
 {
 	struct trust_cache ret = {};
 	cache.version = version;
 	cache.num_entries = 0;
 	cache.entries = NULL;
+	cap = 0;
 	ret.version = version;
 
-	if (nftw(path, tccallback, 20, 0) == -1) {
-		// on macOS, nftw(3) will fail if the path is not a directory, but we don't want that
-		if (errno == ENOTDIR) {
-			struct stat sb;
-			if (stat(path, &sb) == 0 && tccallback(path, &sb, 0, NULL) == 0)
-				goto done;
-		}
-		perror("nftw");
+	if ((path != NULL ? walk_tree(path, cache_add, prov) : walk_list(list, delim, cache_add, prov)) == -1) {
+		free(cache.hashes);
 		return ret;
 	}
 
-done:
 	ret.num_entries = cache.num_entries;
 	ret.hashes = cache.hashes;
 	return ret;
 }
+
+struct trust_cache
+cache_from_tree(const char *path, uint32_t version, struct provenance *prov)
+{
+	return collect(path, NULL, 0, version, prov);
+}
+
+struct trust_cache
+cache_from_list(FILE *list, int delim, uint32_t version, struct provenance *prov)
+{
+	return collect(NULL, list, delim, version, prov);
+}
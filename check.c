@@ -0,0 +1,219 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trustcache.h"
+
+#include "compat.h"
+
+// A cdhash found in the tree and the file it came from.
+struct found {
+	struct trust_cache_entry2 ent;
+	uint32_t path;
+	uint32_t cputype;
+	uint32_t cpusubtype;
+};
+
+struct tree {
+	struct found *found;
+	uint32_t count;
+	uint32_t cap;
+	char *strings;
+	size_t strsize;
+	size_t strcap;
+	size_t lastpath;
+};
+
+/*
+ * Only the sink is serialized by walk_tree(), so this is the one place the
+ * hashes are collected. A file yields all its cdhashes in a row, so its path
+ * is stored once for all of them.
+ */
+static void
+collect(const struct trust_cache_entry2 *ent, const struct tree_origin *origin, void *ctx)
+{
+	struct tree *t = ctx;
+
+	if (t->strsize == 0 || strcmp(t->strings + t->lastpath, origin->path) != 0) {
+		size_t len = strlen(origin->path) + 1;
+		if (t->strsize + len > t->strcap) {
+			t->strcap = t->strcap == 0 ? 4096 : t->strcap * 2;
+			if (t->strcap < t->strsize + len)
+				t->strcap = t->strsize + len;
+			if ((t->strings = realloc(t->strings, t->strcap)) == NULL)
+				exit(1);
+		}
+		memcpy(t->strings + t->strsize, origin->path, len);
+		t->lastpath = t->strsize;
+		t->strsize += len;
+	}
+
+	if (t->count == t->cap) {
+		t->cap = t->cap == 0 ? 64 : t->cap * 2;
+		if ((t->found = realloc(t->found, sizeof(struct found) * t->cap)) == NULL)
+			exit(1);
+	}
+	t->found[t->count++] = (struct found){
+		.ent = *ent,
+		.path = t->lastpath,
+		.cputype = origin->cputype,
+		.cpusubtype = origin->cpusubtype,
+	};
+}
+
+static void
+print_found(const char *what, const struct tree *t, const struct found *f)
+{
+	printf("%s ", what);
+	print_hash((uint8_t *)f->ent.cdhash, false);
+	printf(" %s (%s)\n", t->strings + f->path, arch_name(f->cputype, f->cpusubtype));
+}
+
+int
+tccheck(int argc, char **argv)
+{
+	const char *errstr = NULL;
+	int walkflags = 0;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "Paj:x")) != -1) {
+		switch (ch) {
+			case 'P':
+				walkflags |= WALK_PHYSICAL;
+				break;
+			case 'a':
+				walkflags |= WALK_ALL_CDHASHES;
+				break;
+			case 'j':
+				walk_jobs(strtonum(optarg, 1, 1024, &errstr));
+				if (errstr != NULL) {
+					fprintf(stderr, "job count is %s: %s\n", errstr, optarg);
+					exit(1);
+				}
+				break;
+			case 'x':
+				walkflags |= WALK_XDEV;
+				break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	walk_flags(walkflags);
+	walk_reset();
+
+	if (argc < 2)
+		return -1;
+
+	struct mapped_cache mc;
+	if (mapcache(argv[0], &mc) == -1)
+		return 1;
+	struct trust_cache cache = mc.cache;
+	size_t size = entsize(cache.version);
+
+	// The join needs the cache sorted; one that is not is sorted in a copy.
+	void *sorted = NULL;
+	for (uint32_t i = 1; i < cache.num_entries; i++) {
+		if (ent_cmp((uint8_t *)cache.hashes + size * (i - 1), (uint8_t *)cache.hashes + size * i) > 0) {
+			if ((sorted = malloc(size * cache.num_entries)) == NULL)
+				exit(1);
+			memcpy(sorted, cache.hashes, size * cache.num_entries);
+			qsort(sorted, cache.num_entries, size, ent_cmp);
+			cache.hashes = sorted;
+			break;
+		}
+	}
+
+	struct tree t = {};
+	for (int i = 1; i < argc; i++) {
+		if (walk_tree(argv[i], collect, &t) == -1) {
+			free(t.found);
+			free(t.strings);
+			free(sorted);
+			unmapcache(&mc);
+			return 1;
+		}
+	}
+	qsort(t.found, t.count, sizeof(struct found), ent_cmp);
+
+	// Extra entries are reported with the path they were added from, if it was recorded.
+	struct provenance *prov = provenance_open(argv[0], cache.uuid);
+
+	uint32_t missing = 0, extra = 0, mismatched = 0;
+	uint32_t i = 0, j = 0;
+	while (i < t.count || j < cache.num_entries) {
+		const uint8_t *ent = (uint8_t *)cache.hashes + size * j;
+		int cmp = i == t.count ? 1 : j == cache.num_entries ? -1 : memcmp(t.found[i].ent.cdhash, ent, CS_CDHASH_LEN);
+
+		if (cmp < 0) {
+			print_found("missing", &t, &t.found[i++]);
+			missing++;
+		} else if (cmp > 0) {
+			printf("extra ");
+			print_hash((uint8_t *)ent, false);
+			uint32_t first;
+			if (prov != NULL && provenance_find(prov, ent, &first) != 0) {
+				struct tree_origin origin;
+				provenance_get(prov, first, &origin);
+				printf(" %s (%s)", origin.path, arch_name(origin.cputype, origin.cpusubtype));
+			}
+			printf("\n");
+			extra++;
+			j++;
+		} else {
+			// A version 0 cache has no hash types to disagree with.
+			bool differs = false;
+			for (; i < t.count && memcmp(t.found[i].ent.cdhash, ent, CS_CDHASH_LEN) == 0; i++) {
+				if (cache.version != 0 && !differs &&
+						t.found[i].ent.hash_type != ((struct trust_cache_entry1 *)ent)->hash_type) {
+					print_found("mismatch", &t, &t.found[i]);
+					differs = true;
+				}
+			}
+			mismatched += differs;
+			for (j++; j < cache.num_entries && memcmp((uint8_t *)cache.hashes + size * j, ent, CS_CDHASH_LEN) == 0; j++)
+				;
+		}
+	}
+
+	fprintf(stderr, "%s: %u missing, %u extra, %u mismatched\n", argv[0], missing, extra, mismatched);
+
+	provenance_free(prov);
+	free(t.found);
+	free(t.strings);
+	free(sorted);
+	unmapcache(&mc);
+
+	return missing != 0 || extra != 0 || mismatched != 0;
+}
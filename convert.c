@@ -0,0 +1,203 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trustcache.h"
+#include "uuid/uuid.h"
+
+#include "compat.h"
+
+// Number of entries converted per read, the only buffer that is allocated.
+#define CONVERT_CHUNK 4096
+
+int
+tcconvert(int argc, char **argv)
+{
+	int keepuuid = 0;
+	uuid_t uuid;
+	uint32_t version = UINT32_MAX;
+	uint8_t hash_type = CS_HASHTYPE_SHA256;
+	const char *errstr = NULL;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "t:u:v:")) != -1) {
+		switch (ch) {
+			case 't':
+				hash_type = strtonum(optarg, 1, UINT8_MAX, &errstr);
+				if (errstr != NULL) {
+					fprintf(stderr, "hash type is %s: %s\n", errstr, optarg);
+					exit(1);
+				}
+				break;
+			case 'u':
+				if (strlen(optarg) == 1 && *optarg == '0') {
+					keepuuid = 1;
+				} else {
+					if (uuid_parse(optarg, uuid) != 0) {
+						fprintf(stderr, "Failed to parse %s as a UUID\n", optarg);
+					} else
+						keepuuid = 2;
+				}
+				break;
+			case 'v':
+				if (strlen(optarg) != 1 || (optarg[0] != '0' && optarg[0] != '1' && optarg[0] != '2')) {
+					fprintf(stderr, "Unsupported trustcache version %s\n", optarg);
+					return 1;
+				}
+				version = optarg[0] - '0';
+				break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2 || version == UINT32_MAX)
+		return -1;
+
+	FILE *in = NULL, *out = NULL;
+	struct trust_cache cache;
+	const size_t hdrsize = sizeof(struct trust_cache) - sizeof(struct trust_cache_entry1*);
+
+	if ((in = fopen(argv[0], "rb")) == NULL) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		return 1;
+	}
+
+	if (fread(&cache, hdrsize, 1, in) != 1) {
+		fprintf(stderr, "%s: Truncated trustcache header\n", argv[0]);
+		fclose(in);
+		return 1;
+	}
+	cache.version = le32toh(cache.version);
+	cache.num_entries = le32toh(cache.num_entries);
+
+	size_t insize = entsize(cache.version), outsize = entsize(version);
+	if (insize == 0) {
+		fprintf(stderr, "%s: Unsupported version %i\n", argv[0], cache.version);
+		fclose(in);
+		return 1;
+	}
+
+	switch (keepuuid) {
+		case 0:
+			uuid_generate(cache.uuid);
+			break;
+		case 1:
+			break;
+		case 2:
+			uuid_copy(cache.uuid, uuid);
+			break;
+	}
+
+	/*
+	 * Write into a temporary file next to the output and rename it into
+	 * place, so infile and outfile may be the same path.
+	 */
+	size_t tmplen = strlen(argv[1]) + sizeof(".XXXXXX");
+	char *tmppath = malloc(tmplen);
+	if (tmppath == NULL)
+		exit(1);
+	snprintf(tmppath, tmplen, "%s.XXXXXX", argv[1]);
+	mode_t mask = umask(0);
+	umask(mask);
+	int fd = mkstemp(tmppath);
+	if (fd == -1 || fchmod(fd, 0666 & ~mask) == -1 || (out = fdopen(fd, "wb")) == NULL) {
+		fprintf(stderr, "%s: %s\n", tmppath, strerror(errno));
+		if (fd != -1)
+			unlink(tmppath);
+		fclose(in);
+		free(tmppath);
+		return 1;
+	}
+
+	struct trust_cache hdr = cache;
+	hdr.version = htole32(version);
+	hdr.num_entries = htole32(cache.num_entries);
+	fwrite(&hdr, hdrsize, 1, out);
+
+	uint8_t *inbuf = malloc(insize * CONVERT_CHUNK);
+	uint8_t *outbuf = calloc(CONVERT_CHUNK, outsize);
+	if (inbuf == NULL || outbuf == NULL)
+		exit(1);
+
+	uint32_t done = 0;
+	while (done < cache.num_entries) {
+		size_t want = cache.num_entries - done < CONVERT_CHUNK ? cache.num_entries - done : CONVERT_CHUNK;
+		size_t got = fread(inbuf, insize, want, in);
+		for (size_t i = 0; i < got; i++) {
+			struct trust_cache_entry2 ent = {
+				.hash_type = hash_type,
+			};
+			memcpy(&ent, inbuf + i * insize, insize);
+			memcpy(outbuf + i * outsize, &ent, outsize);
+		}
+		fwrite(outbuf, outsize, got, out);
+		done += got;
+		if (got != want)
+			break;
+	}
+
+	free(inbuf);
+	free(outbuf);
+	fclose(in);
+
+	int ret = 0;
+	if (done != cache.num_entries) {
+		fprintf(stderr, "%s: Truncated trustcache, expected %u entries but found %u\n",
+				argv[0], cache.num_entries, done);
+		ret = 1;
+	} else if (ferror(out)) {
+		fprintf(stderr, "%s: %s\n", tmppath, strerror(errno));
+		ret = 1;
+	}
+
+	if (fclose(out) != 0 && ret == 0) {
+		fprintf(stderr, "%s: %s\n", tmppath, strerror(errno));
+		ret = 1;
+	}
+
+	if (ret == 0 && rename(tmppath, argv[1]) == -1) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		ret = 1;
+	}
+
+	if (ret != 0)
+		unlink(tmppath);
+	free(tmppath);
+
+	return ret;
+}
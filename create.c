@@ -27,6 +27,7 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,6 +37,129 @@
 #include "trustcache.h"
 #include "uuid/uuid.h"
 
+#include "compat.h"
+
+// How many leading bytes the cdhashes of two entries share.
+static size_t
+prefix_len(const uint8_t *a, const uint8_t *b)
+{
+	size_t i = 0;
+	while (i < CS_CDHASH_LEN && a[i] == b[i])
+		i++;
+	return i;
+}
+
+/*
+ * Split a sorted cache into consecutive shards of at most limit entries,
+ * written to path.0, path.1, ..., and describe them in path.manifest.
+ * Shards are cut on cdhash prefix boundaries, at a change of the first byte
+ * whenever the limit leaves room for one, so no prefix spans two shards.
+ * The cache holds no cdhash twice, so some prefix always changes within it.
+ */
+static int
+writeshards(struct trust_cache cache, const char *path, uint32_t limit, bool filter, struct provenance *prov)
+{
+	size_t size = entsize(cache.version);
+	size_t pathlen = strlen(path) + sizeof(".manifest") + 10;
+	char *shardpath = malloc(pathlen);
+	if (shardpath == NULL)
+		exit(1);
+
+	snprintf(shardpath, pathlen, "%s.manifest", path);
+	FILE *m = fopen(shardpath, "w");
+	if (m == NULL) {
+		fprintf(stderr, "%s: %s\n", shardpath, strerror(errno));
+		free(shardpath);
+		return -1;
+	}
+	fprintf(m, "%s\n", TC_MANIFEST_MAGIC);
+
+	uint32_t start = 0, shardnum = 0;
+	while (start < cache.num_entries) {
+		uint8_t *base = (uint8_t *)cache.hashes + (size_t)start * size;
+		uint32_t count = cache.num_entries - start;
+		if (count > limit) {
+			// Cut where the shortest prefix changes, as late as the limit allows.
+			size_t best = CS_CDHASH_LEN;
+			count = 0;
+			for (uint32_t c = limit; c > 0 && best > 0; c--) {
+				size_t p = prefix_len(base + (c - 1) * size, base + c * size);
+				if (p < best) {
+					best = p;
+					count = c;
+				}
+			}
+		}
+
+		struct trust_cache shard = {
+			.version = cache.version,
+			.num_entries = count,
+			.hashes = (trust_cache_hash0 *)base,
+		};
+		uuid_generate(shard.uuid);
+
+		snprintf(shardpath, pathlen, "%s.%u", path, shardnum);
+		if (writetrustcache(shard, shardpath) == -1 ||
+				(filter && writebloom(shard, shardpath) == -1) ||
+				(prov != NULL && provenance_write(prov, shard, shardpath) == -1)) {
+			fclose(m);
+			free(shardpath);
+			return -1;
+		}
+
+		char uuid[37];
+		uuid_unparse(shard.uuid, uuid);
+		const char *name = strrchr(shardpath, '/');
+		fprintf(m, "%s %s %u ", name != NULL ? name + 1 : shardpath, uuid, count);
+		for (size_t j = 0; j < CS_CDHASH_LEN; j++)
+			fprintf(m, "%02x", base[j]);
+		fprintf(m, " ");
+		for (size_t j = 0; j < CS_CDHASH_LEN; j++)
+			fprintf(m, "%02x", base[(count - 1) * size + j]);
+		fprintf(m, "\n");
+
+		start += count;
+		shardnum++;
+	}
+
+	free(shardpath);
+	if (fclose(m) != 0) {
+		fprintf(stderr, "%s.manifest: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Parse a byte count with an optional k, m or g suffix.
+ */
+static long long
+parse_size(const char *s, const char **errstr)
+{
+	char num[32];
+	long long mult = 1;
+	size_t len = strlen(s);
+
+	if (len == 0 || len >= sizeof(num)) {
+		*errstr = "invalid";
+		return 0;
+	}
+	memcpy(num, s, len + 1);
+	switch (num[len - 1]) {
+		case 'g': case 'G':
+			mult *= 1024;
+			/* FALLTHROUGH */
+		case 'm': case 'M':
+			mult *= 1024;
+			/* FALLTHROUGH */
+		case 'k': case 'K':
+			mult *= 1024;
+			num[len - 1] = '\0';
+			break;
+	}
+	return strtonum(num, 1, LLONG_MAX / mult, errstr) * mult;
+}
+
 int
 tccreate(int argc, char **argv)
 {
@@ -45,12 +169,65 @@ tccreate(int argc, char **argv)
 		.num_entries = 0,
 		.entries = NULL,
 	}, append = {};
+	uint32_t maxentries = 0;
+	long long maxbytes = 0, maxmem = 0;
+	bool filter = false;
+	struct provenance *prov = NULL;
+	const char *errstr = NULL, *from = NULL;
+	int delim = '\n', walkflags = 0;
 
 	uuid_generate(cache.uuid);
 
+	static struct option longopts[] = {
+		{ "files-from", required_argument, NULL, 'T' },
+		{ "max-memory", required_argument, NULL, 'm' },
+		{ "null", no_argument, NULL, '0' },
+		{ NULL, 0, NULL, 0 }
+	};
+
 	int ch;
-	while ((ch = getopt(argc, argv, "u:v:")) != -1) {
+	while ((ch = getopt_long(argc, argv, "0FPT:ab:m:n:pu:v:x", longopts, NULL)) != -1) {
 		switch (ch) {
+			case '0':
+				delim = '\0';
+				break;
+			case 'F':
+				filter = true;
+				break;
+			case 'P':
+				walkflags |= WALK_PHYSICAL;
+				break;
+			case 'T':
+				from = optarg;
+				break;
+			case 'a':
+				walkflags |= WALK_ALL_CDHASHES;
+				break;
+			case 'b':
+				maxbytes = parse_size(optarg, &errstr);
+				if (errstr != NULL) {
+					fprintf(stderr, "shard size is %s: %s\n", errstr, optarg);
+					exit(1);
+				}
+				break;
+			case 'm':
+				maxmem = parse_size(optarg, &errstr);
+				if (errstr != NULL) {
+					fprintf(stderr, "memory limit is %s: %s\n", errstr, optarg);
+					exit(1);
+				}
+				break;
+			case 'n':
+				maxentries = strtonum(optarg, 1, UINT32_MAX, &errstr);
+				if (errstr != NULL) {
+					fprintf(stderr, "shard entry count is %s: %s\n", errstr, optarg);
+					exit(1);
+				}
+				break;
+			case 'p':
+				if (prov == NULL)
+					prov = provenance_new();
+				break;
 			case 'u':
 				if (uuid_parse(optarg, cache.uuid) != 0)
 					fprintf(stderr, "Failed to parse %s as a UUID\n", optarg);
@@ -67,17 +244,64 @@ tccreate(int argc, char **argv)
 				else if (optarg[0] == '2')
 					cache.version = 2;
 				break;
+			case 'x':
+				walkflags |= WALK_XDEV;
+				break;
 		}
 	}
 
 	argc -= optind;
 	argv += optind;
+	walk_flags(walkflags);
+	walk_reset();
 
 	if (argc == 0)
 		return -1;
 
-	for (int i = 1; i < argc; i++) {
-		append = cache_from_tree(argv[i], cache.version);
+	FILE *list = NULL;
+	if (from != NULL && (list = strcmp(from, "-") == 0 ? stdin : fopen(from, "r")) == NULL) {
+		fprintf(stderr, "%s: %s\n", from, strerror(errno));
+		return 1;
+	}
+
+	if (maxmem != 0) {
+		if (maxentries != 0 || maxbytes != 0) {
+			fprintf(stderr, "--max-memory cannot be combined with -b or -n\n");
+			return 1;
+		}
+		// The recorded paths and the filter grow with the whole cache, which -m is there to avoid.
+		if (filter || prov != NULL) {
+			fprintf(stderr, "--max-memory cannot be combined with -F or -p\n");
+			return 1;
+		}
+
+		struct extsort *es = extsort_new(cache.version, maxmem);
+		for (int i = 1; i < argc; i++)
+			walk_tree(argv[i], extsort_add, es);
+		if (list != NULL)
+			walk_list(list, delim, extsort_add, es);
+		int ret = extsort_write(es, cache, argv[0]);
+		extsort_free(es);
+		return ret == -1 ? 1 : 0;
+	}
+
+	if (maxbytes != 0) {
+		const size_t hdrsize = sizeof(struct trust_cache) - sizeof(struct trust_cache_entry1*);
+		long long fit = (maxbytes - (long long)hdrsize) / (long long)entsize(cache.version);
+		if (fit < 1) {
+			fprintf(stderr, "shard size %lld is too small for a single entry\n", maxbytes);
+			return 1;
+		}
+		if (maxentries == 0 || fit < maxentries)
+			maxentries = fit > UINT32_MAX ? UINT32_MAX : fit;
+	}
+
+	// The file list, if any, is the last input.
+	for (int i = 1; i < argc + (list != NULL); i++) {
+		if (i < argc)
+			append = cache_from_tree(argv[i], cache.version, prov);
+		else
+			append = cache_from_list(list, delim, cache.version, prov);
 		if (append.version == 0) {
 			if ((cache.hashes = realloc(cache.hashes, sizeof(trust_cache_hash0) *
 							(cache.num_entries + append.num_entries))) == NULL)
@@ -116,11 +340,19 @@ tccreate(int argc, char **argv)
 		qsort(cache.entries, cache.num_entries, sizeof(*cache.entries), ent_cmp);
 	else if (cache.version == 2)
 		qsort(cache.entries, cache.num_entries, sizeof(*cache.entries2), ent_cmp);
+	// Inputs that overlap, or copies of a file, give the same cdhash more than once.
+	cache.num_entries = dedup_entries(cache.hashes, cache.num_entries, entsize(cache.version));
 
-	if (writetrustcache(cache, argv[0]) == -1)
+	if (maxentries != 0) {
+		if (writeshards(cache, argv[0], maxentries, filter, prov) == -1)
+			return 1;
+	} else if (writetrustcache(cache, argv[0]) == -1 ||
+			(filter && writebloom(cache, argv[0]) == -1) ||
+			(prov != NULL && provenance_write(prov, cache, argv[0]) == -1))
 		return 1;
 
 	free(cache.entries);
+	provenance_free(prov);
 
 	return 0;
 }
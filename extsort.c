@@ -0,0 +1,326 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * External merge sort for building caches that do not fit in memory.
+ *
+ * Entries are collected into a fixed size buffer. Whenever it fills up, it
+ * is sorted and spilled to an unlinked temporary file as a run. Runs are
+ * merged in groups of MAX_FANIN as soon as that many of the same level
+ * exist, which keeps the number of open files logarithmic in the number of
+ * entries. When the cache is written, the remaining runs are k-way merged
+ * straight into the output.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trustcache.h"
+
+// Most runs merged at once, and the smallest read buffer given to each.
+#define MAX_FANIN 64
+#define RUN_BUFSIZ 4096
+
+struct run {
+	FILE *f;
+	uint64_t count;
+	unsigned level;
+};
+
+struct extsort {
+	uint32_t version;
+	size_t size;
+	size_t maxmem;
+	uint8_t *buf;
+	uint32_t cap;
+	uint32_t count;
+	struct run *runs;
+	uint32_t nruns;
+	uint64_t total;
+};
+
+static FILE *
+spillfile(void)
+{
+	const char *dir = getenv("TMPDIR");
+	if (dir == NULL || *dir == '\0')
+		dir = "/tmp";
+
+	size_t len = strlen(dir) + sizeof("/trustcache.XXXXXX");
+	char *path = malloc(len);
+	if (path == NULL)
+		exit(1);
+	snprintf(path, len, "%s/trustcache.XXXXXX", dir);
+
+	FILE *f = NULL;
+	int fd = mkstemp(path);
+	if (fd == -1 || (f = fdopen(fd, "w+b")) == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	unlink(path);
+	free(path);
+	return f;
+}
+
+struct extsort *
+extsort_new(uint32_t version, size_t maxmem)
+{
+	struct extsort *es = calloc(1, sizeof(struct extsort));
+	if (es == NULL)
+		exit(1);
+
+	es->version = version;
+	es->size = entsize(version);
+	es->maxmem = maxmem;
+	es->cap = maxmem / es->size > UINT32_MAX ? UINT32_MAX : maxmem / es->size;
+	if (es->cap == 0)
+		es->cap = 1;
+	return es;
+}
+
+/*
+ * Merge n sorted runs into out with a binary min-heap of run indices keyed
+ * on each run's current entry, dropping any whose cdhash was just written.
+ * Returns the number of entries written.
+ */
+static uint64_t
+merge(struct extsort *es, struct run *runs, uint32_t n, FILE *out)
+{
+	size_t bufsiz = es->maxmem / (n + 1);
+	if (bufsiz < RUN_BUFSIZ)
+		bufsiz = RUN_BUFSIZ;
+
+	uint8_t *cur = malloc(es->size * n), last[CS_CDHASH_LEN];
+	uint64_t written = 0;
+	uint32_t *heap = malloc(sizeof(uint32_t) * n);
+	char **bufs = calloc(n, sizeof(char *));
+	if (cur == NULL || heap == NULL || bufs == NULL)
+		exit(1);
+
+	uint32_t len = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		rewind(runs[i].f);
+		if ((bufs[i] = malloc(bufsiz)) == NULL)
+			exit(1);
+		setvbuf(runs[i].f, bufs[i], _IOFBF, bufsiz);
+		if (runs[i].count == 0 || fread(cur + es->size * i, es->size, 1, runs[i].f) != 1)
+			continue;
+		runs[i].count--;
+
+		// sift up
+		uint32_t j = len++;
+		heap[j] = i;
+		while (j > 0) {
+			uint32_t parent = (j - 1) / 2;
+			if (memcmp(cur + es->size * heap[parent], cur + es->size * heap[j], CS_CDHASH_LEN) <= 0)
+				break;
+			uint32_t tmp = heap[parent];
+			heap[parent] = heap[j];
+			heap[j] = tmp;
+			j = parent;
+		}
+	}
+
+	while (len > 0) {
+		uint32_t top = heap[0];
+		if (written == 0 || memcmp(last, cur + es->size * top, CS_CDHASH_LEN) != 0) {
+			fwrite(cur + es->size * top, es->size, 1, out);
+			memcpy(last, cur + es->size * top, CS_CDHASH_LEN);
+			written++;
+		}
+
+		if (runs[top].count > 0 && fread(cur + es->size * top, es->size, 1, runs[top].f) == 1) {
+			runs[top].count--;
+		} else {
+			heap[0] = heap[--len];
+		}
+
+		// sift down
+		uint32_t j = 0;
+		for (;;) {
+			uint32_t l = 2 * j + 1, r = l + 1, min = j;
+			if (l < len && memcmp(cur + es->size * heap[l], cur + es->size * heap[min], CS_CDHASH_LEN) < 0)
+				min = l;
+			if (r < len && memcmp(cur + es->size * heap[r], cur + es->size * heap[min], CS_CDHASH_LEN) < 0)
+				min = r;
+			if (min == j)
+				break;
+			uint32_t tmp = heap[min];
+			heap[min] = heap[j];
+			heap[j] = tmp;
+			j = min;
+		}
+	}
+
+	for (uint32_t i = 0; i < n; i++) {
+		fclose(runs[i].f);
+		free(bufs[i]);
+	}
+	free(bufs);
+	free(heap);
+	free(cur);
+	return written;
+}
+
+/*
+ * Replace the last n runs with a single run holding all of their entries.
+ */
+static void
+collapse(struct extsort *es, uint32_t n)
+{
+	struct run *runs = &es->runs[es->nruns - n];
+	struct run r = {
+		.f = spillfile(),
+		.level = runs[0].level + 1,
+	};
+	r.count = merge(es, runs, n, r.f);
+	if (ferror(r.f)) {
+		fprintf(stderr, "Failed to merge sorted runs: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	es->nruns -= n;
+	es->runs[es->nruns++] = r;
+}
+
+static void
+spill(struct extsort *es)
+{
+	qsort(es->buf, es->count, es->size, es->version == 0 ? hash_cmp : ent_cmp);
+
+	if ((es->runs = realloc(es->runs, sizeof(struct run) * (es->nruns + 1))) == NULL)
+		exit(1);
+	struct run *r = &es->runs[es->nruns++];
+	r->f = spillfile();
+	r->count = es->count;
+	r->level = 0;
+	if (fwrite(es->buf, es->size, es->count, r->f) != es->count) {
+		fprintf(stderr, "Failed to spill sorted run: %s\n", strerror(errno));
+		exit(1);
+	}
+	es->count = 0;
+
+	// Release the buffer while merging, extsort_add() allocates it again.
+	free(es->buf);
+	es->buf = NULL;
+
+	for (;;) {
+		uint32_t n = 0;
+		while (n < es->nruns && es->runs[es->nruns - 1 - n].level == es->runs[es->nruns - 1].level)
+			n++;
+		if (n < MAX_FANIN)
+			break;
+		collapse(es, n);
+	}
+}
+
+void
+extsort_add(const struct trust_cache_entry2 *ent, const struct tree_origin *origin, void *ctx)
+{
+	struct extsort *es = ctx;
+
+	// Another path to a file already added brings nothing new to the cache.
+	if (origin != NULL && origin->repeat)
+		return;
+
+	if (es->count == es->cap)
+		spill(es);
+	// The buffer is only allocated once an entry arrives for it.
+	if (es->buf == NULL && (es->buf = malloc(es->size * es->cap)) == NULL)
+		exit(1);
+
+	memcpy(es->buf + es->size * es->count, ent, es->size);
+	es->count++;
+	es->total++;
+}
+
+int
+extsort_write(struct extsort *es, struct trust_cache cache, const char *path)
+{
+	if (es->total > UINT32_MAX) {
+		fprintf(stderr, "%s: Too many entries for a trustcache\n", path);
+		return -1;
+	}
+
+	// Everything fit in memory, so skip the temporary files.
+	if (es->nruns == 0) {
+		qsort(es->buf, es->count, es->size, es->version == 0 ? hash_cmp : ent_cmp);
+		cache.version = es->version;
+		cache.num_entries = dedup_entries(es->buf, es->count, es->size);
+		cache.hashes = (trust_cache_hash0 *)es->buf;
+		return writetrustcache(cache, path);
+	}
+
+	if (es->count != 0)
+		spill(es);
+	while (es->nruns > MAX_FANIN)
+		collapse(es, MAX_FANIN);
+
+	FILE *f = NULL;
+	if ((f = fopen(path, "wb")) == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	cache.version = htole32(es->version);
+	cache.num_entries = htole32((uint32_t)es->total);
+	fwrite(&cache, sizeof(struct trust_cache) - sizeof(struct trust_cache_entry1*), 1, f);
+
+	uint64_t written = merge(es, es->runs, es->nruns, f);
+	es->nruns = 0;
+
+	// Duplicates only show up while merging, so the count is fixed up after.
+	if (written != es->total) {
+		uint32_t count = htole32((uint32_t)written);
+		fseek(f, offsetof(struct trust_cache, num_entries), SEEK_SET);
+		fwrite(&count, sizeof(count), 1, f);
+	}
+
+	int err = ferror(f);
+	if (fclose(f) != 0 || err) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+void
+extsort_free(struct extsort *es)
+{
+	for (uint32_t i = 0; i < es->nruns; i++)
+		fclose(es->runs[i].f);
+	free(es->runs);
+	free(es->buf);
+	free(es);
+}
@@ -0,0 +1,97 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A main() for the fuzz targets when they are not linked with libFuzzer,
+ * which runs the target once over each file named, or over standard input
+ * if there are none. That is all AFL needs, given @@ or a file on stdin,
+ * and it is how a crash found by either is reproduced.
+ *
+ * usage: fuzz_target [file ...]
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+// Run the target over the whole of f, in a buffer of exactly its size so overreads are caught.
+static int
+run(FILE *f, const char *name)
+{
+	uint8_t *data = NULL;
+	size_t size = 0, cap = 0, got;
+	do {
+		if (size == cap) {
+			cap = cap == 0 ? 65536 : cap * 2;
+			if ((data = realloc(data, cap)) == NULL)
+				exit(1);
+		}
+		got = fread(data + size, 1, cap - size, f);
+		size += got;
+	} while (got != 0);
+
+	if (ferror(f)) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		free(data);
+		return 1;
+	}
+
+	uint8_t *exact = malloc(size == 0 ? 1 : size);
+	if (exact == NULL)
+		exit(1);
+	memcpy(exact, data, size);
+	free(data);
+
+	LLVMFuzzerTestOneInput(exact, size);
+	free(exact);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2)
+		return run(stdin, "stdin");
+
+	int ret = 0;
+	for (int i = 1; i < argc; i++) {
+		FILE *f = fopen(argv[i], "rb");
+		if (f == NULL) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			ret = 1;
+			continue;
+		}
+		ret |= run(f, argv[i]);
+		fclose(f);
+	}
+	return ret;
+}
@@ -0,0 +1,87 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trustcache.h"
+
+bool
+ishexstring(const char *s) {
+	for (; *s != '\0'; s++)
+		if (!isxdigit(*s))
+			return false;
+	return true;
+}
+
+// Whether path is under, or is, dir. Every absolute path is under "/".
+bool
+path_within(const char *path, const char *dir)
+{
+	size_t len = strlen(dir);
+	while (len > 1 && dir[len - 1] == '/')
+		len--;
+	if (len == 1 && dir[0] == '/')
+		return path[0] == '/';
+	return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+void
+hashlist_add(struct hashlist *l, const uint8_t hash[CS_CDHASH_LEN])
+{
+	if (l->count == l->cap) {
+		l->cap = l->cap == 0 ? 64 : l->cap * 2;
+		if ((l->hashes = realloc(l->hashes, sizeof(trust_cache_hash0) * l->cap)) == NULL)
+			exit(1);
+	}
+	memcpy(l->hashes[l->count++], hash, CS_CDHASH_LEN);
+}
+
+// Sort the list so it can be searched with hashlist_has().
+void
+hashlist_sort(struct hashlist *l)
+{
+	qsort(l->hashes, l->count, sizeof(trust_cache_hash0), hash_cmp);
+}
+
+bool
+hashlist_has(const struct hashlist *l, const uint8_t hash[CS_CDHASH_LEN])
+{
+	return l->count != 0 &&
+		bsearch(hash, l->hashes, l->count, sizeof(trust_cache_hash0), hash_cmp) != NULL;
+}
+
+void
+hashlist_free(struct hashlist *l)
+{
+	free(l->hashes);
+	l->hashes = NULL;
+	l->count = l->cap = 0;
+}
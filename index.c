@@ -0,0 +1,149 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Search over sorted caches.
+ *
+ * cdhashes are uniformly distributed, so the position of a hash in a sorted
+ * cache is well predicted by its leading 8 bytes. A few interpolation steps
+ * narrow the range to a handful of entries before finishing with a binary
+ * search, which bounds the worst case on skewed caches.
+ *
+ * The interpolation can run directly over the entries, or over an index
+ * built at load time that packs the leading 8 bytes of every cdhash
+ * together, so each probe pulls in 8 bytes instead of a whole entry.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trustcache.h"
+
+// Interpolation steps taken before falling back to binary search.
+#define INTERPOLATION_STEPS 8
+// Ranges smaller than this are binary searched directly.
+#define INTERPOLATION_MIN 8
+
+struct tc_index {
+	uint32_t count;
+	uint8_t *keys;
+};
+
+static inline uint64_t
+prefix(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return be64toh(v);
+}
+
+/*
+ * Return the first position in [0, n) whose 8 byte prefix is not less than
+ * key, reading the prefix of position i at keys + i * stride.
+ */
+static uint32_t
+lower_bound(const uint8_t *keys, size_t stride, uint32_t n, uint64_t key)
+{
+	uint32_t lo = 0, hi = n;
+
+	for (int step = 0; step < INTERPOLATION_STEPS && hi - lo > INTERPOLATION_MIN; step++) {
+		uint64_t first = prefix(keys + (size_t)lo * stride);
+		uint64_t last = prefix(keys + (size_t)(hi - 1) * stride);
+		if (key <= first)
+			return lo;
+		if (key > last)
+			return hi;
+
+		uint32_t pos = lo + (uint32_t)((double)(key - first) / (double)(last - first) * (hi - 1 - lo));
+		if (prefix(keys + (size_t)pos * stride) < key)
+			lo = pos + 1;
+		else
+			hi = pos;
+	}
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (prefix(keys + (size_t)mid * stride) < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+struct tc_index *
+index_build(const struct trust_cache *cache)
+{
+	size_t size = entsize(cache->version);
+	struct tc_index *idx = malloc(sizeof(struct tc_index));
+	if (idx == NULL || (idx->keys = malloc(sizeof(uint64_t) * (cache->num_entries + 1))) == NULL)
+		exit(1);
+
+	idx->count = cache->num_entries;
+	for (uint32_t i = 0; i < cache->num_entries; i++)
+		memcpy(idx->keys + sizeof(uint64_t) * i, (uint8_t *)cache->hashes + size * i, sizeof(uint64_t));
+	return idx;
+}
+
+void
+index_free(struct tc_index *idx)
+{
+	if (idx == NULL)
+		return;
+	free(idx->keys);
+	free(idx);
+}
+
+/*
+ * Find hash in cache, using idx if it is not NULL. Returns a pointer to the
+ * entry, or NULL if hash is not in the cache.
+ */
+void *
+cache_search(const struct trust_cache *cache, const struct tc_index *idx, const uint8_t hash[CS_CDHASH_LEN])
+{
+	size_t size = entsize(cache->version);
+	uint8_t *entries = (uint8_t *)cache->hashes;
+	uint64_t key = prefix(hash);
+
+	uint32_t i;
+	if (idx != NULL)
+		i = lower_bound(idx->keys, sizeof(uint64_t), idx->count, key);
+	else
+		i = lower_bound(entries, size, cache->num_entries, key);
+
+	// Distinct cdhashes rarely share a prefix, but check every one that does.
+	for (; i < cache->num_entries; i++) {
+		uint8_t *ent = entries + size * i;
+		int cmp = memcmp(ent, hash, CS_CDHASH_LEN);
+		if (cmp == 0)
+			return ent;
+		if (cmp > 0)
+			break;
+	}
+	return NULL;
+}
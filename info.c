@@ -30,21 +30,80 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "trustcache.h"
 
 #include "compat.h"
 
+// Print how many entries have each hash type, flag and constraint category.
+static void
+print_stats(const struct trust_cache *cache)
+{
+	size_t size = entsize(cache->version);
+	uint8_t *base = (uint8_t *)cache->hashes;
+
+	// Duplicates are counted on sorted entries, copied if the cache is not sorted.
+	uint8_t *sorted = base;
+	for (uint32_t i = 1; i < cache->num_entries; i++) {
+		if (ent_cmp(base + size * (i - 1), base + size * i) > 0) {
+			if ((sorted = malloc(size * cache->num_entries)) == NULL)
+				exit(1);
+			memcpy(sorted, base, size * cache->num_entries);
+			qsort(sorted, cache->num_entries, size, ent_cmp);
+			break;
+		}
+	}
+	uint32_t unique = cache->num_entries != 0;
+	for (uint32_t i = 1; i < cache->num_entries; i++)
+		unique += ent_cmp(sorted + size * (i - 1), sorted + size * i) != 0;
+	if (sorted != base)
+		free(sorted);
+	printf("unique cdhashes = %u\n", unique);
+
+	if (cache->version == 0)
+		return;
+
+	// Entries of versions 1 and 2 start alike, so both are read as version 1 here.
+	uint32_t types[UINT8_MAX + 1] = {}, categories[UINT8_MAX + 1] = {};
+	uint32_t amfid = 0, ane = 0, none = 0, other = 0;
+	for (uint32_t i = 0; i < cache->num_entries; i++) {
+		const struct trust_cache_entry1 *ent = (struct trust_cache_entry1 *)(base + size * i);
+		types[ent->hash_type]++;
+		amfid += ent->flags & CS_TRUST_CACHE_AMFID;
+		ane += (ent->flags & CS_TRUST_CACHE_ANE) >> 1;
+		none += ent->flags == 0;
+		other += (ent->flags & ~(CS_TRUST_CACHE_AMFID | CS_TRUST_CACHE_ANE)) != 0;
+		if (cache->version == 2)
+			categories[cache->entries2[i].constraintCategory]++;
+	}
+
+	for (unsigned t = 0; t <= UINT8_MAX; t++)
+		if (types[t] != 0)
+			printf("hash type %u = %u\n", t, types[t]);
+	printf("flags none = %u\n", none);
+	printf("flags CS_TRUST_CACHE_AMFID = %u\n", amfid);
+	printf("flags CS_TRUST_CACHE_ANE = %u\n", ane);
+	if (other != 0)
+		printf("flags other = %u\n", other);
+
+	if (cache->version == 1)
+		return;
+	for (unsigned t = 0; t <= UINT8_MAX; t++)
+		if (categories[t] != 0)
+			printf("constraint category %u = %u\n", t, categories[t]);
+}
+
 int
 tcinfo(int argc, char **argv)
 {
 	struct trust_cache cache;
-	bool headeronly = false, onlyhash = false;
+	bool headeronly = false, onlyhash = false, stats = false;
 	uint32_t entrynum = 0;
 	const char *errstr = NULL;
 
 	int ch;
-	while ((ch = getopt(argc, argv, "che:")) != -1) {
+	while ((ch = getopt(argc, argv, "chse:")) != -1) {
 		switch (ch) {
 			case 'h':
 				headeronly = true;
@@ -59,6 +118,9 @@ tcinfo(int argc, char **argv)
 			case 'c':
 				onlyhash = true;
 				break;
+			case 's':
+				stats = true;
+				break;
 		}
 	}
 
@@ -72,6 +134,10 @@ tcinfo(int argc, char **argv)
 
 	if (entrynum == 0 && !onlyhash)
 		print_header(cache);
+	if (stats) {
+		print_stats(&cache);
+		goto done;
+	}
 	if (!headeronly) {
 		if (onlyhash) {
 			for (uint32_t i = 0; i < cache.num_entries; i++) {
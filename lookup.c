@@ -0,0 +1,243 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trustcache.h"
+
+struct shard {
+	char *path;
+	uint8_t first[CS_CDHASH_LEN];
+	uint8_t last[CS_CDHASH_LEN];
+	bool loaded;
+	struct mapped_cache mc;
+	struct bloom *filter;
+	struct provenance *prov;
+};
+
+struct manifest {
+	uint32_t count;
+	struct shard *shards;
+};
+
+static int
+parse_hash(const char *s, uint8_t hash[CS_CDHASH_LEN])
+{
+	if (strlen(s) != CS_CDHASH_LEN * 2)
+		return -1;
+	for (size_t j = 0; j < CS_CDHASH_LEN; j++)
+		if (sscanf(s + 2 * j, "%02hhx", &hash[j]) != 1)
+			return -1;
+	return 0;
+}
+
+static bool
+ismanifest(const char *path)
+{
+	char buf[sizeof(TC_MANIFEST_MAGIC) - 1];
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return false;
+	bool ret = fread(buf, sizeof(buf), 1, f) == 1 && memcmp(buf, TC_MANIFEST_MAGIC, sizeof(buf)) == 0;
+	fclose(f);
+	return ret;
+}
+
+static struct manifest
+openmanifest(const char *path)
+{
+	struct manifest m = {};
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	// Shard paths are relative to the directory holding the manifest.
+	const char *slash = strrchr(path, '/');
+	int dirlen = slash != NULL ? slash - path + 1 : 0;
+
+	char *line = NULL;
+	size_t linecap = 0;
+	unsigned lineno = 0;
+	while (getline(&line, &linecap, f) > 0) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		char name[1024], uuid[37], first[CS_CDHASH_LEN * 2 + 1], last[CS_CDHASH_LEN * 2 + 1];
+		uint32_t count;
+		if ((m.shards = realloc(m.shards, sizeof(struct shard) * (m.count + 1))) == NULL)
+			exit(1);
+		struct shard *s = &m.shards[m.count];
+		memset(s, 0, sizeof(*s));
+		if (sscanf(line, "%1023s %36s %u %40s %40s", name, uuid, &count, first, last) != 5 ||
+				parse_hash(first, s->first) != 0 || parse_hash(last, s->last) != 0) {
+			fprintf(stderr, "%s:%u: Malformed shard entry\n", path, lineno);
+			exit(1);
+		}
+		size_t len = dirlen + strlen(name) + 1;
+		if ((s->path = malloc(len)) == NULL)
+			exit(1);
+		snprintf(s->path, len, "%.*s%s", dirlen, path, name);
+		m.count++;
+	}
+
+	free(line);
+	fclose(f);
+	return m;
+}
+
+/*
+ * Find the shard whose range could hold hash. Shards are written in
+ * ascending order, so the answer is the last one starting at or before it.
+ */
+static struct shard *
+route(struct manifest *m, const uint8_t hash[CS_CDHASH_LEN])
+{
+	uint32_t lo = 0, hi = m->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (memcmp(m->shards[mid].first, hash, CS_CDHASH_LEN) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || memcmp(m->shards[lo - 1].last, hash, CS_CDHASH_LEN) < 0)
+		return NULL;
+	return &m->shards[lo - 1];
+}
+
+/*
+ * Map the shard on first use. Its filter, if there is an up to date one,
+ * answers most misses without touching the mapped entries. If paths is set,
+ * the files each found cdhash came from are listed after it.
+ */
+static bool
+lookup(struct shard *s, const uint8_t hash[CS_CDHASH_LEN], bool paths)
+{
+	if (!s->loaded) {
+		if (mapcache(s->path, &s->mc) == -1)
+			exit(1);
+		s->filter = bloom_open(s->path, &s->mc.cache);
+		if (paths && (s->prov = provenance_open(s->path, s->mc.cache.uuid)) == NULL)
+			fprintf(stderr, "%s.paths is missing or out of date\n", s->path);
+		s->loaded = true;
+	}
+
+	struct trust_cache *cache = &s->mc.cache;
+	if (s->filter != NULL && !bloom_test(s->filter, hash))
+		return false;
+
+	void *ent = cache_search(cache, NULL, hash);
+	if (ent == NULL)
+		return false;
+
+	if (cache->version == 0)
+		print_hash(ent, true);
+	else if (cache->version == 1)
+		print_entry(*(struct trust_cache_entry1 *)ent);
+	else if (cache->version == 2)
+		print_entry2(*(struct trust_cache_entry2 *)ent);
+
+	if (s->prov != NULL) {
+		uint32_t first, count = provenance_find(s->prov, hash, &first);
+		for (uint32_t i = first; i < first + count; i++) {
+			struct tree_origin origin;
+			provenance_get(s->prov, i, &origin);
+			printf("\t%s (%s)\n", origin.path, arch_name(origin.cputype, origin.cpusubtype));
+		}
+	}
+	return true;
+}
+
+int
+tclookup(int argc, char **argv)
+{
+	bool paths = false;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "p")) != -1) {
+		switch (ch) {
+			case 'p':
+				paths = true;
+				break;
+			default:
+				return -1;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 2)
+		return -1;
+
+	struct manifest m = {};
+	struct shard single = {
+		.path = argv[0],
+	};
+	bool sharded = ismanifest(argv[0]);
+	int ret = 0;
+
+	if (sharded)
+		m = openmanifest(argv[0]);
+
+	uint8_t hash[CS_CDHASH_LEN];
+	for (int i = 1; i < argc; i++) {
+		if (parse_hash(argv[i], hash) != 0) {
+			fprintf(stderr, "%s is not a valid CDHash\n", argv[i]);
+			exit(1);
+		}
+
+		struct shard *s = sharded ? route(&m, hash) : &single;
+		if (s == NULL || !lookup(s, hash, paths)) {
+			fprintf(stderr, "%s not found\n", argv[i]);
+			ret = 1;
+		}
+	}
+
+	for (uint32_t i = 0; i < m.count; i++) {
+		unmapcache(&m.shards[i].mc);
+		bloom_free(m.shards[i].filter);
+		provenance_free(m.shards[i].prov);
+		free(m.shards[i].path);
+	}
+	free(m.shards);
+	unmapcache(&single.mc);
+	bloom_free(single.filter);
+	provenance_free(single.prov);
+
+	return ret;
+}
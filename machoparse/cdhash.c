@@ -44,6 +44,8 @@
  *
  */
 #include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -67,6 +69,7 @@
 #	include <libkern/OSByteOrder.h>
 #	define bswap32(x) OSSwapInt32(x)
 #	define be32toh(x) OSSwapBigToHostInt32(x)
+#	define be64toh(x) OSSwapBigToHostInt64(x)
 #elif __has_include(<endian.h>)
 #	include <endian.h>
 #	define bswap32(x) __builtin_bswap32(x)
@@ -81,63 +84,131 @@
 #define ERROR(x, ...)
 #define DEBUG_TRACE(x, y, ...)
 
-static uint32_t
-swap(const void *h, const void *h2, const uint32_t s) {
-	uint32_t magic = *((uint32_t*)(h == NULL ? h2 : h));
-	if (magic == MH_CIGAM || magic == MH_CIGAM_64)
-		return bswap32(s);
-	else
-		return s;
+// Set by cdhash_all() before any hashing starts, and only read afterwards.
+static bool all_cds = false;
+
+void
+cdhash_all(bool all) {
+	all_cds = all;
+}
+
+/*
+ * A thin Mach-O whose header has been checked, decoded once so the load
+ * commands can be walked without looking at the magic again.
+ */
+struct macho {
+	const uint8_t *file;
+	size_t size;
+	bool swapped;
+	uint32_t cputype;
+	uint32_t cpusubtype;
+	uint32_t ncmds;
+	// The load commands, which are known to lie within the file.
+	const uint8_t *cmds;
+	size_t sizeofcmds;
+};
+
+// Read a 32-bit field in the file's byte order, wherever it is aligned.
+static inline __attribute__((always_inline)) uint32_t
+load32(const uint8_t *p, bool swapped) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return swapped ? bswap32(v) : v;
 }
 
-// Check whether the file looks like a Mach-O file.
+// Read a big endian field, as in fat headers and code signatures, wherever it is aligned.
+static inline __attribute__((always_inline)) uint32_t
+load_be32(const void *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return be32toh(v);
+}
+
+static inline __attribute__((always_inline)) uint64_t
+load_be64(const void *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return be64toh(v);
+}
+
+#define FIELD(p, type, field) ((const uint8_t *)(p) + offsetof(type, field))
+
+// Check whether the file looks like a Mach-O file, and decode its header if so.
 static bool
-macho_identify(const struct mach_header_64 *mh, const struct mach_header *mh32, size_t size) {
-	uint32_t magic = mh != NULL ? mh->magic : mh32->magic;
+macho_open(const void *file, size_t size, struct macho *m) {
 	// Check the file size and magic.
-	if (size < 0x1000 || (magic != MH_MAGIC_64 &&
-				magic != MH_CIGAM_64 && magic != MH_MAGIC &&
-				magic != MH_CIGAM)) {
+	if (size < 0x1000)
+		return false;
+	uint32_t magic = load32(file, false);
+	size_t hdrsize;
+	switch (magic) {
+		case MH_MAGIC_64:
+		case MH_CIGAM_64:
+			hdrsize = sizeof(struct mach_header_64);
+			break;
+		case MH_MAGIC:
+		case MH_CIGAM:
+			hdrsize = sizeof(struct mach_header);
+			break;
+		default:
+			return false;
+	}
+
+	const uint8_t *p = file;
+	m->file = p;
+	m->size = size;
+	m->swapped = magic == MH_CIGAM_64 || magic == MH_CIGAM;
+	m->cputype = load32(p + offsetof(struct mach_header, cputype), m->swapped);
+	m->cpusubtype = load32(p + offsetof(struct mach_header, cpusubtype), m->swapped);
+	m->ncmds = load32(p + offsetof(struct mach_header, ncmds), m->swapped);
+	m->sizeofcmds = load32(p + offsetof(struct mach_header, sizeofcmds), m->swapped);
+	m->cmds = p + hdrsize;
+	if (m->sizeofcmds > size - hdrsize) {
+		ERROR("Load commands run past the end of the file\n");
 		return false;
 	}
 	return true;
 }
 
-// Get the next load command in a Mach-O file.
-static const void *
-macho_next_load_command(const struct mach_header_64 *mh, const struct mach_header *mh32, const void *lc) {
-	const struct load_command *next = lc;
-
-	if (next == NULL) {
-		if (mh != NULL)
-			next = (const struct load_command *)(mh + 1);
-		else
-			next = (const struct load_command *)(mh32 + 1);
-	} else {
-		next = (const struct load_command *)((uint8_t *)next + swap(mh, mh32, next->cmdsize));
-	}
-	if (mh != NULL) {
-		if ((uintptr_t)next >= (uintptr_t)(mh + 1) + swap(mh, mh32, mh->sizeofcmds)) {
-			next = NULL;
+/*
+ * Find LC_CODE_SIGNATURE. Every command must fit in sizeofcmds and be at
+ * least as big as a load command, so a cmdsize of 0 cannot loop forever.
+ * Inlined into one copy per byte order, in which swapped is a constant.
+ */
+static inline __attribute__((always_inline)) bool
+macho_code_signature(const struct macho *m, bool swapped, uint32_t *dataoff, uint32_t *datasize) {
+	const uint8_t *lc = m->cmds, *end = m->cmds + m->sizeofcmds;
+	for (uint32_t i = 0; i < m->ncmds; i++) {
+		if ((size_t)(end - lc) < sizeof(struct load_command)) {
+			ERROR("Load command %u is truncated\n", i);
+			return false;
 		}
-	} else {
-		if ((uintptr_t)next >= (uintptr_t)(mh32 + 1) + swap(mh, mh32, mh32->sizeofcmds)) {
-			next = NULL;
+		uint32_t cmd = load32(lc + offsetof(struct load_command, cmd), swapped);
+		uint32_t cmdsize = load32(lc + offsetof(struct load_command, cmdsize), swapped);
+		if (cmdsize < sizeof(struct load_command) || cmdsize > (size_t)(end - lc)) {
+			ERROR("Load command %u has invalid size %u\n", i, cmdsize);
+			return false;
+		}
+		if (cmd == LC_CODE_SIGNATURE) {
+			if (cmdsize < sizeof(struct linkedit_data_command))
+				return false;
+			*dataoff = load32(lc + offsetof(struct linkedit_data_command, dataoff), swapped);
+			*datasize = load32(lc + offsetof(struct linkedit_data_command, datasize), swapped);
+			return true;
 		}
+		lc += cmdsize;
 	}
-	return next;
+	return false;
 }
 
-// Find the next load command in a Mach-O file matching the given type.
-static const void *
-macho_find_load_command(const struct mach_header_64 *mh, const struct mach_header *mh32, uint32_t command, const void *lc) {
-	const struct load_command *loadcmd = lc;
-	for (;;) {
-		loadcmd = macho_next_load_command(mh, mh32, loadcmd);
-		if (loadcmd == NULL || swap(mh, mh32, loadcmd->cmd) == command) {
-			return loadcmd;
-		}
-	}
+static bool
+macho_code_signature_native(const struct macho *m, uint32_t *dataoff, uint32_t *datasize) {
+	return macho_code_signature(m, false, dataoff, datasize);
+}
+
+static bool
+macho_code_signature_swapped(const struct macho *m, uint32_t *dataoff, uint32_t *datasize) {
+	return macho_code_signature(m, true, dataoff, datasize);
 }
 
 // Validate a CS_CodeDirectory and return its true length.
@@ -150,13 +221,13 @@ cs_codedirectory_validate(CS_CodeDirectory *cd, size_t size) {
 		return 0;
 	}
 	// Validate the magic.
-	uint32_t magic = be32toh(cd->magic);
+	uint32_t magic = load_be32(FIELD(cd, CS_CodeDirectory, magic));
 	if (magic != CSMAGIC_CODEDIRECTORY) {
 		ERROR("CS_CodeDirectory has incorrect magic\n");
 		return 0;
 	}
 	// Validate the length.
-	uint32_t length = be32toh(cd->length);
+	uint32_t length = load_be32(FIELD(cd, CS_CodeDirectory, length));
 	if (length > size) {
 		ERROR("CS_CodeDirectory has invalid length\n");
 		return 0;
@@ -173,21 +244,20 @@ cs_superblob_validate(CS_SuperBlob *sb, size_t size) {
 		return 0;
 	}
 	// Validate the magic.
-	uint32_t magic = be32toh(sb->magic);
+	uint32_t magic = load_be32(FIELD(sb, CS_SuperBlob, magic));
 	if (magic != CSMAGIC_EMBEDDED_SIGNATURE) {
 		ERROR("CS_SuperBlob has incorrect magic\n");
 		return 0;
 	}
 	// Validate the length.
-	uint32_t length = be32toh(sb->length);
+	uint32_t length = load_be32(FIELD(sb, CS_SuperBlob, length));
 	if (length > size) {
 		ERROR("CS_SuperBlob has invalid length\n");
 		return 0;
 	}
-	uint32_t count = be32toh(sb->count);
+	uint32_t count = load_be32(FIELD(sb, CS_SuperBlob, count));
 	// Validate the count.
-	CS_BlobIndex *index = &sb->index[count];
-	if (count >= 0x10000 || (uintptr_t)index > (uintptr_t)sb + size) {
+	if (count >= 0x10000 || (size - sizeof(*sb)) / sizeof(CS_BlobIndex) < count) {
 		ERROR("CS_SuperBlob has invalid count\n");
 		return 0;
 	}
@@ -230,8 +300,8 @@ cdhash_sha384(CS_CodeDirectory *cd, size_t length, void *cdhash) {
 // Compute the cdhash from a CS_CodeDirectory.
 static bool
 cs_codedirectory_cdhash(CS_CodeDirectory *cd, struct hashes *cdhash) {
-	size_t length = be32toh(cd->length);
-	switch (cd->hashType) {
+	size_t length = load_be32(FIELD(cd, CS_CodeDirectory, length));
+	switch (*FIELD(cd, CS_CodeDirectory, hashType)) {
 		case CS_HASHTYPE_SHA1:
 			DEBUG_TRACE(2, "Using SHA1\n");
 			cdhash_sha1(cd, length, cdhash->cdhash);
@@ -248,7 +318,7 @@ cs_codedirectory_cdhash(CS_CodeDirectory *cd, struct hashes *cdhash) {
 			cdhash->hash_type = CS_HASHTYPE_SHA384;
 			return true;
 	}
-	ERROR("Unsupported hash type %d\n", cd->hashType);
+	ERROR("Unsupported hash type %d\n", *FIELD(cd, CS_CodeDirectory, hashType));
 	return false;
 }
 
@@ -265,28 +335,34 @@ cs_codedirectory_rank(CS_CodeDirectory *cd) {
 	};
 	// Define the rank of the code directory as its index in the array plus one.
 	for (unsigned i = 0; i < sizeof(ranked_hash_types) / sizeof(ranked_hash_types[0]); i++) {
-		if (ranked_hash_types[i] == cd->hashType) {
+		if (ranked_hash_types[i] == *FIELD(cd, CS_CodeDirectory, hashType)) {
 			return (i + 1);
 		}
 	}
 	return 0;
 }
 
-// Compute the cdhash from a CS_SuperBlob.
-static bool
-cs_superblob_cdhash(CS_SuperBlob *sb, size_t size, void *cdhash) {
+/*
+ * Compute the cdhash from a CS_SuperBlob: that of the best code directory,
+ * or of every one with a supported hash type if cdhash_all() was set, each
+ * hashed as soon as it is found. Returns the number of cdhashes written to
+ * cdhash.
+ */
+static int
+cs_superblob_cdhash(CS_SuperBlob *sb, size_t size, struct hashes *cdhash) {
 	// Iterate through each index searching for the best code directory.
 	CS_CodeDirectory *best_cd = NULL;
 	unsigned best_cd_rank = 0;
-	uint32_t count = be32toh(sb->count);
-	for (size_t i = 0; i < count; i++) {
-		CS_BlobIndex *index = &sb->index[i];
-		uint32_t type = be32toh(index->type);
-		uint32_t offset = be32toh(index->offset);
+	int count = 0;
+	uint32_t nindex = load_be32(FIELD(sb, CS_SuperBlob, count));
+	for (size_t i = 0; i < nindex; i++) {
+		const uint8_t *index = FIELD(sb, CS_SuperBlob, index) + i * sizeof(CS_BlobIndex);
+		uint32_t type = load_be32(FIELD(index, CS_BlobIndex, type));
+		uint32_t offset = load_be32(FIELD(index, CS_BlobIndex, offset));
 		// Validate the offset.
 		if (offset > size) {
 			ERROR("CS_SuperBlob has out-of-bounds CS_BlobIndex\n");
-			return false;
+			return 0;
 		}
 		// Look for a code directory.
 		if (type == CSSLOT_CODEDIRECTORY ||
@@ -294,11 +370,13 @@ cs_superblob_cdhash(CS_SuperBlob *sb, size_t size, void *cdhash) {
 			CS_CodeDirectory *cd = (CS_CodeDirectory *)((uint8_t *)sb + offset);
 			size_t cd_size = cs_codedirectory_validate(cd, size - offset);
 			if (cd_size == 0) {
-				return false;
+				return 0;
 			}
-			DEBUG_TRACE(2, "CS_CodeDirectory { hashType = %u }\n", cd->hashType);
+			DEBUG_TRACE(2, "CS_CodeDirectory { hashType = %u }\n", *FIELD(cd, CS_CodeDirectory, hashType));
 			// Rank the code directory to see if it's better than our previous best.
 			unsigned cd_rank = cs_codedirectory_rank(cd);
+			if (all_cds && cd_rank > 0 && count < CDHASHES_PER_SLICE && cs_codedirectory_cdhash(cd, &cdhash[count]))
+				count++;
 			if (cd_rank > best_cd_rank) {
 				best_cd = cd;
 				best_cd_rank = cd_rank;
@@ -308,22 +386,24 @@ cs_superblob_cdhash(CS_SuperBlob *sb, size_t size, void *cdhash) {
 	// If we didn't find a code directory, error.
 	if (best_cd == NULL) {
 		ERROR("CS_SuperBlob does not have a code directory\n");
-		return false;
+		return 0;
 	}
+	if (all_cds)
+		return count;
 	// Hash the code directory.
 	return cs_codedirectory_cdhash(best_cd, cdhash);
 }
 
 // Compute the cdhash from a csblob.
-static bool
-csblob_cdhash(CS_GenericBlob *blob, size_t size, void *cdhash) {
+static int
+csblob_cdhash(CS_GenericBlob *blob, size_t size, struct hashes *cdhash) {
 	// Make sure we at least have a CS_GenericBlob.
 	if (size < sizeof(*blob)) {
 		ERROR("CSBlob is too small\n");
 		return false;
 	}
-	uint32_t magic = be32toh(blob->magic);
-	uint32_t length = be32toh(blob->length);
+	uint32_t magic = load_be32(FIELD(blob, CS_GenericBlob, magic));
+	uint32_t length = load_be32(FIELD(blob, CS_GenericBlob, length));
 	DEBUG_TRACE(2, "CS_GenericBlob { %08x, %u }, size = %zu\n", magic, length, size);
 	// Make sure the length is sensible.
 	if (length > size) {
@@ -350,113 +430,177 @@ csblob_cdhash(CS_GenericBlob *blob, size_t size, void *cdhash) {
 	return false;
 }
 
-// Compute the cdhash for a Mach-O file.
-static bool
-compute_cdhash_macho(const struct mach_header_64 *mh, const struct mach_header *mh32, size_t size, struct hashes *cdhash) {
+// Compute the cdhashes of a thin Mach-O, at most CDHASHES_PER_SLICE, returning how many there are.
+static int
+compute_cdhash(const void *file, size_t size, struct hashes *cdhash) {
+	struct macho m;
+	if (!macho_open(file, size, &m)) {
+		ERROR("Unrecognized file format\n");
+		return 0;
+	}
+
 	// Find the code signature command.
-	const struct linkedit_data_command *cs_cmd =
-		macho_find_load_command(mh, mh32, LC_CODE_SIGNATURE, NULL);
-	if (cs_cmd == NULL) {
+	uint32_t dataoff = 0, datasize = 0;
+	if (!(m.swapped ? macho_code_signature_swapped(&m, &dataoff, &datasize) :
+				macho_code_signature_native(&m, &dataoff, &datasize))) {
 		ERROR("No code signature\n");
-		return false;
+		return 0;
 	}
-	const uint8_t *cs_data, *cs_end;
 	// Check that the code signature is in-bounds.
-	if (mh != NULL) {
-		cs_data = (const uint8_t *)mh + swap(mh, NULL, cs_cmd->dataoff);
-		cs_end = cs_data + swap(mh, NULL, cs_cmd->datasize);
-		if (!((uint8_t *)mh < cs_data && cs_data < cs_end && cs_end <= (uint8_t *)mh + size)) {
-			ERROR("Invalid code signature\n");
-			return false;
-		}
-	} else {
-		cs_data = (const uint8_t *)mh32 + swap(mh32, NULL, cs_cmd->dataoff);
-		cs_end = cs_data + swap(mh32, NULL, cs_cmd->datasize);
-		if (!((uint8_t *)mh32 < cs_data && cs_data < cs_end && cs_end <= (uint8_t *)mh32 + size)) {
-			ERROR("Invalid code signature\n");
-			return false;
-		}
+	if (dataoff == 0 || datasize == 0 || dataoff > size || datasize > size - dataoff) {
+		ERROR("Invalid code signature\n");
+		return 0;
 	}
+
 	// Check that the code signature data looks correct.
-	return csblob_cdhash((CS_GenericBlob *)cs_data, cs_end - cs_data, cdhash);
+	int count = csblob_cdhash((CS_GenericBlob *)(m.file + dataoff), datasize, cdhash);
+	for (int i = 0; i < count; i++) {
+		cdhash[i].cputype = m.cputype;
+		cdhash[i].cpusubtype = m.cpusubtype;
+	}
+	return count;
 }
 
-static bool
-compute_cdhash(const void *file, size_t size, struct hashes *cdhash) {
-	// Try to compute the cdhash for a Mach-O file.
-	const struct mach_header_64 *mh = file;
-	const struct mach_header *mh32 = file;
-	if (mh->magic == MH_MAGIC_64 || mh->magic == MH_CIGAM_64) {
-		mh32 = NULL;
-	} else {
-		mh = NULL;
-	}
+// Universal binaries at least this big have their slices hashed at the same time.
+#define FAT_PARALLEL_MIN (16 * 1024 * 1024)
 
-	if (macho_identify(mh, mh32, size)) {
-		//if (!macho_validate(mh, mh32, size)) {
-		//	ERROR("Bad Mach-O file\n");
-		//	return false;
-		//}
-		return compute_cdhash_macho(mh, mh32, size, cdhash);
-	}
-	// What is it?
-	ERROR("Unrecognized file format\n");
-	return false;
+struct slice {
+	const void *file;
+	size_t size;
+	struct hashes cdhash[CDHASHES_PER_SLICE];
+	int count;
+};
+
+static void *
+compute_slice(void *arg) {
+	struct slice *s = arg;
+	s->count = compute_cdhash(s->file, s->size, s->cdhash);
+	return NULL;
 }
 
 static void
 compute_cdhashes(const void *file, size_t size, struct cdhashes *h) {
-	const struct fat_header *fh = NULL;
-	if (*((uint32_t*)file) == FAT_MAGIC || *((uint32_t*)file) == FAT_CIGAM)
-		fh = file;
-
-	if (fh != NULL) {
-		struct fat_arch *fa = (struct fat_arch *)(fh + 1);
-		h->h = malloc(sizeof(struct hashes) * be32toh(fh->nfat_arch));
-		for (uint32_t i = 0; i < be32toh(fh->nfat_arch); i++) {
-			if (compute_cdhash(file + be32toh(fa->offset), be32toh(fa->size), &h->h[h->count])) {
-				h->count++;
-			} else {
-				// If any slice is not signed we will just skip the whole binary
-				h->count = 0;
-				return;
-			}
-			fa++;
+	h->count = 0;
+	uint32_t magic = load32(file, false);
+	bool fat64 = magic == FAT_MAGIC_64 || magic == FAT_CIGAM_64;
+	if (!fat64 && magic != FAT_MAGIC && magic != FAT_CIGAM) {
+		struct hashes cdhash[CDHASHES_PER_SLICE];
+		if (size >= sizeof(struct mach_header))
+			h->count = compute_cdhash(file, size, cdhash);
+		memcpy(h->h, cdhash, h->count * sizeof(struct hashes));
+		return;
+	}
+
+	// The fat header and its table are big endian, whatever the slices are.
+	size_t archsize = fat64 ? sizeof(struct fat_arch_64) : sizeof(struct fat_arch);
+	if (size < sizeof(struct fat_header))
+		return;
+	uint32_t nslices = load_be32(FIELD(file, struct fat_header, nfat_arch));
+	if (nslices == 0 || nslices > CDHASHES_SLICES_MAX || (size - sizeof(struct fat_header)) / archsize < nslices) {
+		ERROR("Bad fat header\n");
+		return;
+	}
+
+	struct slice slices[CDHASHES_SLICES_MAX];
+	for (uint32_t i = 0; i < nslices; i++) {
+		uint64_t offset, slicesize;
+		const uint8_t *fa = (const uint8_t *)file + sizeof(struct fat_header) + i * archsize;
+		if (fat64) {
+			offset = load_be64(FIELD(fa, struct fat_arch_64, offset));
+			slicesize = load_be64(FIELD(fa, struct fat_arch_64, size));
+		} else {
+			offset = load_be32(FIELD(fa, struct fat_arch, offset));
+			slicesize = load_be32(FIELD(fa, struct fat_arch, size));
+		}
+		if (offset > size || slicesize > size - offset || slicesize < sizeof(struct mach_header)) {
+			ERROR("Slice %u is out of bounds\n", i);
+			return;
+		}
+		slices[i].file = (const uint8_t *)file + offset;
+		slices[i].size = slicesize;
+	}
+
+	// The first slice is hashed on the calling thread, as is any slice a thread could not be started for.
+	pthread_t threads[CDHASHES_SLICES_MAX];
+	bool started[CDHASHES_SLICES_MAX] = {};
+	if (size >= FAT_PARALLEL_MIN)
+		for (uint32_t i = 1; i < nslices; i++)
+			started[i] = pthread_create(&threads[i], NULL, compute_slice, &slices[i]) == 0;
+	for (uint32_t i = 0; i < nslices; i++)
+		if (!started[i])
+			compute_slice(&slices[i]);
+
+	int count = 0;
+	bool ok = true;
+	for (uint32_t i = 0; i < nslices; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		ok = ok && slices[i].count != 0;
+		if (ok) {
+			memcpy(&h->h[count], slices[i].cdhash, slices[i].count * sizeof(struct hashes));
+			count += slices[i].count;
 		}
-	} else {
-		h->h = malloc(sizeof(struct hashes));
-		h->count = compute_cdhash(file, size, &h->h[0]);
 	}
+
+	// If any slice is not signed we will just skip the whole binary
+	if (ok)
+		h->count = count;
 }
 
 int
-find_cdhash(const char *path, const struct stat *sb, struct cdhashes *h) {
-	int success = 0;
-	size_t fileoff = 0;
+find_cdhash_mem(const void *file, size_t size, struct cdhashes *h) {
+	if (size < sizeof(uint32_t))
+		return 0;
+	compute_cdhashes(file, size, h);
+	return true;
+}
 
-	int fd;
-	fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		ERROR("Could not open \"%s\"\n", path);
-		goto fail_0;
+size_t
+find_cdhash_batch(const struct cdhash_buf *bufs, size_t n, struct cdhashes *results) {
+	size_t found = 0;
+	for (size_t i = 0; i < n; i++) {
+		results[i].count = 0;
+		if (bufs[i].data != NULL && find_cdhash_mem(bufs[i].data, bufs[i].size, &results[i]) && results[i].count != 0)
+			found++;
+	}
+	return found;
+}
+
+int
+find_cdhash_fd(int fd, const struct stat *sb, struct cdhashes *h) {
+	// Callers that have not stat'd the file leave it to us.
+	struct stat fsb;
+	if (sb == NULL) {
+		if (fstat(fd, &fsb) != 0 || !S_ISREG(fsb.st_mode))
+			return 0;
+		sb = &fsb;
 	}
 	size_t size = sb->st_size;
+	if (size < sizeof(uint32_t))
+		return 0;
 	// Map the file into memory.
-	DEBUG_TRACE(2, "Mapping %s size %zu offset %zu\n", path, size, fileoff);
-	size -= fileoff;
-	uint8_t *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, fileoff);
+	DEBUG_TRACE(2, "Mapping fd %d size %zu\n", fd, size);
+	uint8_t *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
 	if (file == MAP_FAILED) {
-		ERROR("Could not map \"%s\"\n", path);
-		goto fail_1;
+		ERROR("Could not map fd %d\n", fd);
+		return 0;
 	}
 	DEBUG_TRACE(3, "file[0] = %lx\n", *(uint64_t *)file);
 	// Compute the cdhash.
 	compute_cdhashes(file, size, h);
-	success = true;
 
 	munmap(file, size);
-fail_1:
+	return true;
+}
+
+int
+find_cdhash(const char *path, const struct stat *sb, struct cdhashes *h) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ERROR("Could not open \"%s\"\n", path);
+		return 0;
+	}
+	int success = find_cdhash_fd(fd, sb, h);
 	close(fd);
-fail_0:
 	return success;
 }
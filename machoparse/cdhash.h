@@ -3,16 +3,28 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include "cs_blobs.h"
 
 struct hashes {
 	uint32_t hash_type;
 	uint8_t cdhash[20];
+	uint32_t cputype;
+	uint32_t cpusubtype;
 };
 
+// Files with more slices than this are skipped.
+#define CDHASHES_SLICES_MAX 16
+
+// The primary code directory and every alternate one.
+#define CDHASHES_PER_SLICE (CSSLOT_ALTERNATE_CODEDIRECTORY_MAX + 1)
+
+// Room for every code directory of every slice, as cdhash_all() reports them.
+#define CDHASHES_MAX (CDHASHES_SLICES_MAX * CDHASHES_PER_SLICE)
+
 struct cdhashes {
 	int count;
-	struct hashes *h;
+	struct hashes h[CDHASHES_MAX];
 };
 
 /*
@@ -29,6 +41,42 @@ struct cdhashes {
  */
 //bool compute_cdhash(const void *file, size_t size, struct cdhash *cdhash);
 
+/*
+ * Report the cdhash of every code directory of a file, the primary one and
+ * each alternate with a supported hash type, instead of only the one the
+ * kernel would pick. Set once before hashing.
+ */
+void cdhash_all(bool all);
+
 int find_cdhash(const char *path, const struct stat *sb, struct cdhashes *h);
+int find_cdhash_fd(int fd, const struct stat *sb, struct cdhashes *h);
+int find_cdhash_mem(const void *file, size_t size, struct cdhashes *h);
+
+// One in-memory Mach-O, thin or FAT, for find_cdhash_batch().
+struct cdhash_buf {
+	const void *data;
+	size_t size;
+};
+
+/*
+ * find_cdhash_batch
+ *
+ * Description:
+ * 	Compute the cdhashes of n Mach-O files already in memory, such as
+ * 	archive members or downloads, without touching the filesystem. No
+ * 	state is shared between calls, so any number of threads may call it at
+ * 	once on their own buffers, as long as cdhash_all() is not called while
+ * 	they do.
+ *
+ * Parameters:
+ * 	bufs				The files to hash.
+ * 	n				The number of files in bufs.
+ * 	results			out	On return, results[i] holds the cdhashes of
+ * 					bufs[i], or a count of 0 if it has none.
+ *
+ * Returns:
+ * 	The number of files with at least one cdhash.
+ */
+size_t find_cdhash_batch(const struct cdhash_buf *bufs, size_t n, struct cdhashes *results);
 
 #endif
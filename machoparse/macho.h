@@ -67,7 +67,8 @@ struct fat_arch {
 struct fat_arch_64 {
 	cpu_type_t	cputype;
 	cpu_subtype_t	cpusubtype;
-	uint32_t	offset;
-	uint32_t	size;
+	uint64_t	offset;
+	uint64_t	size;
 	uint32_t	align;
+	uint32_t	reserved;
 };
@@ -0,0 +1,611 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A compact archive format for storing and transferring caches.
+ *
+ * The header is followed by a body, compressed with gzip or zstd or stored
+ * as is, holding the most common attribute tuples (hash type, flags,
+ * constraint category and the reserved byte) and then the entries in sorted
+ * order. Each entry is one control byte, whose low 5 bits count the leading
+ * bytes its cdhash shares with the previous one and whose high 3 bits pick
+ * its tuple, followed by the rest of the cdhash. Tuple index 7 is an escape
+ * for a tuple not in the table, which then follows the cdhash. The body
+ * ends with the CRC-32 of everything before it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef ZSTD
+#include <zstd.h>
+#endif
+
+#include "trustcache.h"
+#include "uuid/uuid.h"
+
+#include "compat.h"
+
+#define PACK_MAGIC	"TCPK"
+#define PACK_FORMAT	1
+
+#define PACK_NONE	0
+#define PACK_GZIP	1
+#define PACK_ZSTD	2
+
+// Tuples kept in the table, the last index being the escape.
+#define PACK_TUPLES	7
+#define PACK_ESCAPE	7
+// Distinct tuples counted when choosing the table.
+#define PACK_COUNTED	256
+// Longest encoded entry: control byte, a whole cdhash and an escaped tuple.
+#define PACK_MAXENT	(1 + CS_CDHASH_LEN + 4)
+#define PACK_BUFSIZ	65536
+// Entries decoded per write.
+#define IMPORT_CHUNK	4096
+
+struct pack_header {
+	char magic[4];
+	uint8_t format;
+	uint8_t version;
+	uint8_t compression;
+	uint8_t ntuples;
+	uuid_t uuid;
+	uint32_t num_entries;
+} __attribute__((__packed__));
+
+struct packout {
+	gzFile gz;
+#ifdef ZSTD
+	int fd;
+	ZSTD_CCtx *zc;
+	uint8_t *zbuf;
+	size_t zcap;
+#endif
+	uLong crc;
+	bool failed;
+	size_t len;
+	uint8_t buf[PACK_BUFSIZ];
+};
+
+struct packin {
+	gzFile gz;
+#ifdef ZSTD
+	int fd;
+	ZSTD_DCtx *zd;
+	ZSTD_inBuffer in;
+	uint8_t *zbuf;
+	size_t zcap;
+#endif
+	uLong crc;
+	bool failed;
+	size_t pos;
+	size_t len;
+	uint8_t buf[PACK_BUFSIZ];
+};
+
+static void
+out_write(struct packout *o, const void *data, size_t len)
+{
+#ifdef ZSTD
+	if (o->zc != NULL) {
+		ZSTD_inBuffer in = { .src = data, .size = len, .pos = 0 };
+		while (in.pos < in.size) {
+			ZSTD_outBuffer out = { .dst = o->zbuf, .size = o->zcap, .pos = 0 };
+			if (ZSTD_isError(ZSTD_compressStream2(o->zc, &out, &in, ZSTD_e_continue)) ||
+					write(o->fd, o->zbuf, out.pos) != (ssize_t)out.pos) {
+				o->failed = true;
+				return;
+			}
+		}
+		return;
+	}
+#endif
+	if (len != 0 && gzwrite(o->gz, data, len) != (int)len)
+		o->failed = true;
+}
+
+static void
+out_flush(struct packout *o)
+{
+	o->crc = crc32(o->crc, o->buf, o->len);
+	out_write(o, o->buf, o->len);
+	o->len = 0;
+}
+
+// Room for at least one more entry at o->buf + o->len.
+static inline uint8_t *
+out_reserve(struct packout *o)
+{
+	if (o->len + PACK_MAXENT > sizeof(o->buf))
+		out_flush(o);
+	return o->buf + o->len;
+}
+
+// Write the checksum and whatever the compressor still holds.
+static int
+out_finish(struct packout *o)
+{
+	out_flush(o);
+	uint32_t crc = htole32(o->crc);
+	out_write(o, &crc, sizeof(crc));
+#ifdef ZSTD
+	if (o->zc != NULL) {
+		ZSTD_inBuffer in = { .src = NULL, .size = 0, .pos = 0 };
+		size_t left;
+		do {
+			ZSTD_outBuffer out = { .dst = o->zbuf, .size = o->zcap, .pos = 0 };
+			left = ZSTD_compressStream2(o->zc, &out, &in, ZSTD_e_end);
+			if (ZSTD_isError(left) || write(o->fd, o->zbuf, out.pos) != (ssize_t)out.pos) {
+				o->failed = true;
+				break;
+			}
+		} while (left != 0);
+		ZSTD_freeCCtx(o->zc);
+		free(o->zbuf);
+		return close(o->fd) == -1 || o->failed ? -1 : 0;
+	}
+#endif
+	return gzclose(o->gz) != Z_OK || o->failed ? -1 : 0;
+}
+
+// Read up to len bytes of the body, fewer only at its end.
+static size_t
+in_read(struct packin *in, uint8_t *dst, size_t len)
+{
+#ifdef ZSTD
+	if (in->zd != NULL) {
+		ZSTD_outBuffer out = { .dst = dst, .size = len, .pos = 0 };
+		while (out.pos < len) {
+			if (in->in.pos == in->in.size) {
+				ssize_t n = read(in->fd, in->zbuf, in->zcap);
+				if (n <= 0)
+					break;
+				in->in.size = n;
+				in->in.pos = 0;
+			}
+			if (ZSTD_isError(ZSTD_decompressStream(in->zd, &out, &in->in))) {
+				in->failed = true;
+				break;
+			}
+		}
+		return out.pos;
+	}
+#endif
+	int n = gzread(in->gz, dst, len);
+	if (n < 0) {
+		in->failed = true;
+		return 0;
+	}
+	return n;
+}
+
+/*
+ * Make at least want bytes available at in->buf + in->pos, unless the body
+ * ends first, and return how many are. Bytes before in->pos are consumed
+ * and added to the checksum.
+ */
+static inline size_t
+in_fill(struct packin *in, size_t want)
+{
+	size_t avail = in->len - in->pos;
+	if (avail >= want)
+		return avail;
+
+	in->crc = crc32(in->crc, in->buf, in->pos);
+	memmove(in->buf, in->buf + in->pos, avail);
+	in->pos = 0;
+	in->len = avail;
+	while (in->len < want) {
+		size_t n = in_read(in, in->buf + in->len, sizeof(in->buf) - in->len);
+		if (n == 0)
+			break;
+		in->len += n;
+	}
+	return in->len;
+}
+
+static void
+in_close(struct packin *in)
+{
+#ifdef ZSTD
+	if (in->zd != NULL) {
+		ZSTD_freeDCtx(in->zd);
+		free(in->zbuf);
+		close(in->fd);
+		return;
+	}
+#endif
+	gzclose(in->gz);
+}
+
+// The attribute bytes of an entry as stored, 0 for a version 0 cache.
+static inline uint32_t
+tuple_of(const uint8_t *ent, size_t size)
+{
+	uint32_t t = 0;
+	memcpy(&t, ent + CS_CDHASH_LEN, size - CS_CDHASH_LEN);
+	return t;
+}
+
+struct tuple_count {
+	uint32_t tuple;
+	uint32_t count;
+};
+
+// Pick the most common tuples of a cache, most common first.
+static uint8_t
+choose_tuples(const uint8_t *base, uint32_t n, size_t size, uint32_t tuples[PACK_TUPLES])
+{
+	struct tuple_count counts[PACK_COUNTED];
+	uint32_t ncounts = 0, last = 0;
+
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t t = tuple_of(base + size * i, size);
+		// Neighbouring entries nearly always share a tuple.
+		if (ncounts != 0 && counts[last].tuple == t) {
+			counts[last].count++;
+			continue;
+		}
+		uint32_t j;
+		for (j = 0; j < ncounts && counts[j].tuple != t; j++)
+			;
+		if (j == ncounts) {
+			if (ncounts == PACK_COUNTED)
+				continue;
+			counts[ncounts++] = (struct tuple_count){ .tuple = t };
+		}
+		counts[j].count++;
+		last = j;
+	}
+
+	uint8_t ntuples = 0;
+	for (; ntuples < PACK_TUPLES && ntuples < ncounts; ntuples++) {
+		uint32_t best = ntuples;
+		for (uint32_t j = ntuples + 1; j < ncounts; j++)
+			if (counts[j].count > counts[best].count)
+				best = j;
+		struct tuple_count tmp = counts[ntuples];
+		counts[ntuples] = counts[best];
+		counts[best] = tmp;
+		tuples[ntuples] = counts[ntuples].tuple;
+	}
+	return ntuples;
+}
+
+int
+tcexport(int argc, char **argv)
+{
+	uint8_t compression = PACK_NONE;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "c:")) != -1) {
+		switch (ch) {
+			case 'c':
+				if (strcmp(optarg, "gzip") == 0)
+					compression = PACK_GZIP;
+				else if (strcmp(optarg, "zstd") == 0)
+					compression = PACK_ZSTD;
+				else if (strcmp(optarg, "none") == 0)
+					compression = PACK_NONE;
+				else {
+					fprintf(stderr, "Unsupported compression %s\n", optarg);
+					return 1;
+				}
+				break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
+		return -1;
+
+#ifndef ZSTD
+	if (compression == PACK_ZSTD) {
+		fprintf(stderr, "zstd support was not built in\n");
+		return 1;
+	}
+#endif
+
+	struct mapped_cache mc;
+	if (mapcache(argv[0], &mc) == -1)
+		return 1;
+	struct trust_cache cache = mc.cache;
+	size_t size = entsize(cache.version);
+
+	// Prefixes are only shared between neighbours once the cache is sorted.
+	void *sorted = NULL;
+	for (uint32_t i = 1; i < cache.num_entries; i++) {
+		if (ent_cmp((uint8_t *)cache.hashes + size * (i - 1), (uint8_t *)cache.hashes + size * i) > 0) {
+			if ((sorted = malloc(size * cache.num_entries)) == NULL)
+				exit(1);
+			memcpy(sorted, cache.hashes, size * cache.num_entries);
+			qsort(sorted, cache.num_entries, size, ent_cmp);
+			cache.hashes = sorted;
+			break;
+		}
+	}
+	const uint8_t *base = (uint8_t *)cache.hashes;
+
+	uint32_t tuples[PACK_TUPLES];
+	struct pack_header hdr = {
+		.magic = PACK_MAGIC,
+		.format = PACK_FORMAT,
+		.version = cache.version,
+		.compression = compression,
+		.ntuples = choose_tuples(base, cache.num_entries, size, tuples),
+		.num_entries = htole32(cache.num_entries),
+	};
+	uuid_copy(hdr.uuid, cache.uuid);
+
+	int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1 || write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		if (fd != -1)
+			close(fd);
+		free(sorted);
+		unmapcache(&mc);
+		return 1;
+	}
+
+	struct packout *o = calloc(1, sizeof(struct packout));
+	if (o == NULL)
+		exit(1);
+	o->crc = crc32(0, NULL, 0);
+#ifdef ZSTD
+	if (compression == PACK_ZSTD) {
+		o->fd = fd;
+		o->zcap = ZSTD_CStreamOutSize();
+		if ((o->zc = ZSTD_createCCtx()) == NULL || (o->zbuf = malloc(o->zcap)) == NULL)
+			exit(1);
+		ZSTD_CCtx_setParameter(o->zc, ZSTD_c_checksumFlag, 1);
+	} else
+#endif
+	// Stored bodies go through zlib too, in its transparent mode.
+	if ((o->gz = gzdopen(fd, compression == PACK_GZIP ? "wb" : "wbT")) == NULL)
+		exit(1);
+
+	for (uint8_t t = 0; t < hdr.ntuples; t++) {
+		memcpy(out_reserve(o), &tuples[t], sizeof(tuples[t]));
+		o->len += sizeof(tuples[t]);
+	}
+
+	for (uint32_t i = 0; i < cache.num_entries; i++) {
+		const uint8_t *ent = base + size * i;
+		const uint8_t *prev = ent - size;
+		uint8_t prefix = 0;
+		if (i != 0)
+			while (prefix < CS_CDHASH_LEN && ent[prefix] == prev[prefix])
+				prefix++;
+
+		uint32_t t = tuple_of(ent, size);
+		uint8_t idx = 0;
+		while (idx < hdr.ntuples && tuples[idx] != t)
+			idx++;
+		if (idx == hdr.ntuples)
+			idx = PACK_ESCAPE;
+
+		uint8_t *p = out_reserve(o);
+		*p++ = idx << 5 | prefix;
+		memcpy(p, ent + prefix, CS_CDHASH_LEN - prefix);
+		p += CS_CDHASH_LEN - prefix;
+		if (idx == PACK_ESCAPE) {
+			memcpy(p, &t, sizeof(t));
+			p += sizeof(t);
+		}
+		o->len = p - o->buf;
+	}
+
+	int ret = 0;
+	if (out_finish(o) == -1) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		unlink(argv[1]);
+		ret = 1;
+	}
+
+	free(o);
+	free(sorted);
+	unmapcache(&mc);
+	return ret;
+}
+
+int
+tcimport(int argc, char **argv)
+{
+	uint32_t version = UINT32_MAX;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "v:")) != -1) {
+		switch (ch) {
+			case 'v':
+				if (strlen(optarg) != 1 || (optarg[0] != '0' && optarg[0] != '1' && optarg[0] != '2')) {
+					fprintf(stderr, "Unsupported trustcache version %s\n", optarg);
+					return 1;
+				}
+				version = optarg[0] - '0';
+				break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
+		return -1;
+
+	struct pack_header hdr;
+	int fd = open(argv[0], O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		return 1;
+	}
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr.magic, PACK_MAGIC, sizeof(hdr.magic)) != 0) {
+		fprintf(stderr, "%s: Not a trustcache archive\n", argv[0]);
+		close(fd);
+		return 1;
+	}
+	hdr.num_entries = le32toh(hdr.num_entries);
+	if (hdr.format != PACK_FORMAT || entsize(hdr.version) == 0 || hdr.ntuples > PACK_TUPLES ||
+			hdr.compression > PACK_ZSTD) {
+		fprintf(stderr, "%s: Unsupported trustcache archive\n", argv[0]);
+		close(fd);
+		return 1;
+	}
+	if (version == UINT32_MAX)
+		version = hdr.version;
+
+	struct packin *in = calloc(1, sizeof(struct packin));
+	if (in == NULL)
+		exit(1);
+	in->crc = crc32(0, NULL, 0);
+	if (hdr.compression == PACK_ZSTD) {
+#ifdef ZSTD
+		in->fd = fd;
+		in->zcap = ZSTD_DStreamInSize();
+		if ((in->zd = ZSTD_createDCtx()) == NULL || (in->zbuf = malloc(in->zcap)) == NULL)
+			exit(1);
+		in->in.src = in->zbuf;
+#else
+		fprintf(stderr, "%s: zstd support was not built in\n", argv[0]);
+		close(fd);
+		free(in);
+		return 1;
+#endif
+	} else if ((in->gz = gzdopen(fd, "rb")) == NULL)
+		exit(1);
+
+	// Entries upgraded from version 0 get the same hash type convert gives them.
+	uint8_t tuples[PACK_ESCAPE + 1][4] = {};
+	if (hdr.version == 0)
+		tuples[0][0] = CS_HASHTYPE_SHA256;
+	const char *err = NULL;
+	if (in_fill(in, 4 * hdr.ntuples) < 4 * (size_t)hdr.ntuples)
+		err = "Truncated";
+	else if (hdr.version != 0) {
+		memcpy(tuples, in->buf, 4 * hdr.ntuples);
+		in->pos = 4 * hdr.ntuples;
+	} else
+		in->pos = 4 * hdr.ntuples;
+
+	FILE *out = NULL;
+	if (err == NULL && (out = fopen(argv[1], "wb")) == NULL) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		in_close(in);
+		free(in);
+		return 1;
+	}
+
+	const size_t hdrsize = sizeof(struct trust_cache) - sizeof(struct trust_cache_entry1*);
+	size_t size = entsize(version);
+	struct trust_cache cache = {
+		.version = htole32(version),
+		.num_entries = htole32(hdr.num_entries),
+	};
+	uuid_copy(cache.uuid, hdr.uuid);
+	if (out != NULL)
+		fwrite(&cache, hdrsize, 1, out);
+
+	uint8_t *chunk = malloc(size * IMPORT_CHUNK);
+	if (chunk == NULL)
+		exit(1);
+
+	uint8_t cur[CS_CDHASH_LEN] = {};
+	uint32_t done = 0;
+	while (err == NULL && done < hdr.num_entries) {
+		uint32_t n = hdr.num_entries - done < IMPORT_CHUNK ? hdr.num_entries - done : IMPORT_CHUNK;
+		uint8_t *dst = chunk;
+		for (uint32_t i = 0; i < n; i++, dst += size) {
+			size_t avail = in_fill(in, PACK_MAXENT);
+			const uint8_t *p = in->buf + in->pos;
+			uint8_t prefix = p[0] & 0x1f, idx = p[0] >> 5;
+			size_t len = 1 + CS_CDHASH_LEN - prefix + (idx == PACK_ESCAPE ? 4 : 0);
+			if (avail == 0 || prefix > CS_CDHASH_LEN || avail < len) {
+				err = avail == 0 || prefix <= CS_CDHASH_LEN ? "Truncated" : "Corrupt";
+				break;
+			}
+			if ((idx != PACK_ESCAPE && idx >= hdr.ntuples) || (done + i == 0 && prefix != 0)) {
+				err = "Corrupt";
+				break;
+			}
+			memcpy(cur + prefix, p + 1, CS_CDHASH_LEN - prefix);
+			if (idx == PACK_ESCAPE)
+				memcpy(tuples[PACK_ESCAPE], p + 1 + CS_CDHASH_LEN - prefix, 4);
+			in->pos += len;
+
+			memcpy(dst, cur, CS_CDHASH_LEN);
+			memcpy(dst + CS_CDHASH_LEN, tuples[hdr.version == 0 ? 0 : idx], size - CS_CDHASH_LEN);
+		}
+		if (err == NULL) {
+			fwrite(chunk, size, n, out);
+			done += n;
+		}
+	}
+	free(chunk);
+
+	if (err == NULL) {
+		uint32_t crc;
+		uLong sum = crc32(in->crc, in->buf, in->pos);
+		if (in_fill(in, sizeof(crc) + 1) != sizeof(crc))
+			err = in->len < sizeof(crc) ? "Truncated" : "Corrupt";
+		else {
+			memcpy(&crc, in->buf + in->pos, sizeof(crc));
+			if (le32toh(crc) != sum)
+				err = "Corrupt";
+		}
+	}
+	if (err == NULL && in->failed)
+		err = "Corrupt";
+	in_close(in);
+	free(in);
+
+	int ret = 0;
+	if (err != NULL) {
+		fprintf(stderr, "%s: %s trustcache archive\n", argv[0], err);
+		ret = 1;
+	} else if (ferror(out)) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		ret = 1;
+	}
+	if (out != NULL && fclose(out) != 0 && ret == 0) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		ret = 1;
+	}
+	if (ret != 0 && out != NULL)
+		unlink(argv[1]);
+
+	return ret;
+}
@@ -0,0 +1,412 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Provenance sidecar, written beside a cache as <cache>.paths, recording
+ * which file and slice each cdhash was computed from. Records are sorted by
+ * cdhash so the origins of a hash are found with a binary search instead of
+ * scanning the trees again. Paths are kept once each in a string table
+ * after the records.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trustcache.h"
+#include "uuid/uuid.h"
+
+#define PROVENANCE_MAGIC "TCPV"
+#define PROVENANCE_VERSION 1
+
+#define CPU_ARCH_ABI64		0x01000000
+#define CPU_ARCH_ABI64_32	0x02000000
+#define CPU_TYPE_X86		7
+#define CPU_TYPE_ARM		12
+#define CPU_SUBTYPE_MASK	0xff000000
+#define CPU_SUBTYPE_ARM64E	2
+
+struct provenance_header {
+	char magic[4];
+	uint32_t version;
+	uuid_t uuid;
+	uint32_t count;
+	uint32_t strsize;
+} __attribute__((__packed__));
+
+// Stored little endian, both on disk and while being built.
+struct provenance_record {
+	uint8_t cdhash[CS_CDHASH_LEN];
+	uint8_t hash_type;
+	uint8_t reserved[3];
+	uint32_t cputype;
+	uint32_t cpusubtype;
+	uint32_t path;
+} __attribute__((__packed__));
+
+struct provenance {
+	struct provenance_record *records;
+	uint32_t count, cap;
+	char *strings;
+	uint32_t strsize, strcap;
+	uint32_t lastpath;
+	bool sorted;
+	void *map;
+	size_t maplen;
+};
+
+static char *
+provenance_path(const char *cachepath)
+{
+	size_t len = strlen(cachepath) + sizeof(".paths");
+	char *path = malloc(len);
+	if (path == NULL)
+		exit(1);
+	snprintf(path, len, "%s.paths", cachepath);
+	return path;
+}
+
+bool
+provenance_exists(const char *cachepath)
+{
+	char *path = provenance_path(cachepath);
+	bool ret = access(path, F_OK) == 0;
+	free(path);
+	return ret;
+}
+
+struct provenance *
+provenance_new(void)
+{
+	struct provenance *p = calloc(1, sizeof(struct provenance));
+	if (p == NULL)
+		exit(1);
+	p->lastpath = UINT32_MAX;
+	p->sorted = true;
+	return p;
+}
+
+void
+provenance_free(struct provenance *p)
+{
+	if (p == NULL)
+		return;
+	if (p->map != NULL) {
+		munmap(p->map, p->maplen);
+	} else {
+		free(p->records);
+		free(p->strings);
+	}
+	free(p);
+}
+
+static uint32_t
+add_string(struct provenance *p, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	if ((uint64_t)p->strsize + len > UINT32_MAX) {
+		fprintf(stderr, "Too many paths for a provenance sidecar\n");
+		exit(1);
+	}
+	while (p->strsize + len > p->strcap) {
+		p->strcap = p->strcap == 0 ? 4096 : p->strcap * 2;
+		if ((p->strings = realloc(p->strings, p->strcap)) == NULL)
+			exit(1);
+	}
+	memcpy(p->strings + p->strsize, s, len);
+	p->strsize += len;
+	return p->strsize - len;
+}
+
+/*
+ * Every slice of a file is reported one after the other, so only comparing
+ * against the last path added is enough to store each path once.
+ */
+void
+provenance_add(struct provenance *p, const struct trust_cache_entry2 *entry, const struct tree_origin *origin)
+{
+	if (p->count == p->cap) {
+		p->cap = p->cap == 0 ? 64 : p->cap * 2;
+		if ((p->records = realloc(p->records, p->cap * sizeof(struct provenance_record))) == NULL)
+			exit(1);
+	}
+
+	if (p->lastpath == UINT32_MAX || strcmp(p->strings + p->lastpath, origin->path) != 0)
+		p->lastpath = add_string(p, origin->path);
+
+	struct provenance_record *r = &p->records[p->count++];
+	memset(r, 0, sizeof(*r));
+	memcpy(r->cdhash, entry->cdhash, CS_CDHASH_LEN);
+	r->hash_type = entry->hash_type;
+	r->cputype = htole32(origin->cputype);
+	r->cpusubtype = htole32(origin->cpusubtype);
+	r->path = htole32(p->lastpath);
+	p->sorted = false;
+}
+
+uint32_t
+provenance_count(const struct provenance *p)
+{
+	return p->count;
+}
+
+const uint8_t *
+provenance_hash(const struct provenance *p, uint32_t i)
+{
+	return p->records[i].cdhash;
+}
+
+uint8_t
+provenance_get(const struct provenance *p, uint32_t i, struct tree_origin *origin)
+{
+	const struct provenance_record *r = &p->records[i];
+	origin->path = p->strings + le32toh(r->path);
+	origin->cputype = le32toh(r->cputype);
+	origin->cpusubtype = le32toh(r->cpusubtype);
+	return r->hash_type;
+}
+
+// Copy the records of src whose cdhash is still in cache.
+void
+provenance_copy(struct provenance *dst, const struct provenance *src, const struct trust_cache *cache)
+{
+	for (uint32_t i = 0; i < src->count; i++) {
+		if (cache_search(cache, NULL, src->records[i].cdhash) == NULL)
+			continue;
+		struct trust_cache_entry2 ent = {
+			.hash_type = src->records[i].hash_type,
+		};
+		struct tree_origin origin;
+		memcpy(ent.cdhash, src->records[i].cdhash, CS_CDHASH_LEN);
+		provenance_get(src, i, &origin);
+		provenance_add(dst, &ent, &origin);
+	}
+}
+
+static int
+record_cmp(const void *vp1, const void *vp2)
+{
+	const struct provenance_record *r1 = vp1, *r2 = vp2;
+	int ret = memcmp(r1->cdhash, r2->cdhash, CS_CDHASH_LEN);
+	if (ret != 0)
+		return ret;
+	return le32toh(r1->path) < le32toh(r2->path) ? -1 : le32toh(r1->path) > le32toh(r2->path);
+}
+
+// Index of the first record whose cdhash is not below hash (or above it, if after).
+static uint32_t
+record_bound(const struct provenance *p, const uint8_t hash[CS_CDHASH_LEN], bool after)
+{
+	uint32_t lo = 0, hi = p->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp = memcmp(p->records[mid].cdhash, hash, CS_CDHASH_LEN);
+		if (cmp < 0 || (after && cmp == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+uint32_t
+provenance_find(const struct provenance *p, const uint8_t hash[CS_CDHASH_LEN], uint32_t *first)
+{
+	*first = record_bound(p, hash, false);
+	return record_bound(p, hash, true) - *first;
+}
+
+/*
+ * Write the records covering the cdhashes of cache, which must be sorted,
+ * tagged with its uuid so a sidecar left behind by another cache is ignored.
+ * A shard only gets the records for its own range, along with the paths
+ * they refer to.
+ */
+int
+provenance_write(struct provenance *p, struct trust_cache cache, const char *cachepath)
+{
+	if (!p->sorted) {
+		qsort(p->records, p->count, sizeof(struct provenance_record), record_cmp);
+		p->sorted = true;
+	}
+
+	size_t size = entsize(cache.version);
+	uint32_t start = 0, end = 0;
+	if (cache.num_entries != 0) {
+		start = record_bound(p, (uint8_t *)cache.hashes, false);
+		end = record_bound(p, (uint8_t *)cache.hashes + size * (cache.num_entries - 1), true);
+	}
+
+	// Renumber the paths in use; a path's slices are never far apart, so a small map does.
+	struct provenance *out = provenance_new();
+	size_t mapcap = 64;
+	while (mapcap < (size_t)(end - start) * 2)
+		mapcap *= 2;
+	uint32_t (*map)[2] = malloc(mapcap * sizeof(*map));
+	if (map == NULL)
+		exit(1);
+	memset(map, 0xff, mapcap * sizeof(*map));
+
+	if ((out->records = malloc((end - start == 0 ? 1 : end - start) * sizeof(struct provenance_record))) == NULL)
+		exit(1);
+	for (uint32_t i = start; i < end; i++) {
+		struct provenance_record r = p->records[i];
+		uint32_t old = le32toh(r.path);
+
+		// The same file hashed again, as append does for entries already recorded, is kept once.
+		bool dup = false;
+		for (uint32_t k = out->count; k-- > 0 && memcmp(out->records[k].cdhash, r.cdhash, CS_CDHASH_LEN) == 0;) {
+			if (out->records[k].cputype == r.cputype && out->records[k].cpusubtype == r.cpusubtype &&
+					strcmp(out->strings + le32toh(out->records[k].path), p->strings + old) == 0) {
+				dup = true;
+				break;
+			}
+		}
+		if (dup)
+			continue;
+
+		size_t slot = (old * 2654435761u) & (mapcap - 1);
+		while (map[slot][0] != UINT32_MAX && map[slot][0] != old)
+			slot = (slot + 1) & (mapcap - 1);
+		if (map[slot][0] == UINT32_MAX) {
+			map[slot][0] = old;
+			map[slot][1] = add_string(out, p->strings + old);
+		}
+		r.path = htole32(map[slot][1]);
+		out->records[out->count++] = r;
+	}
+	free(map);
+
+	char *path = provenance_path(cachepath);
+	FILE *f = NULL;
+	if ((f = fopen(path, "wb")) == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		free(path);
+		provenance_free(out);
+		return -1;
+	}
+
+	struct provenance_header hdr = {
+		.magic = PROVENANCE_MAGIC,
+		.version = htole32(PROVENANCE_VERSION),
+		.count = htole32(out->count),
+		.strsize = htole32(out->strsize),
+	};
+	uuid_copy(hdr.uuid, cache.uuid);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	fwrite(out->records, sizeof(struct provenance_record), out->count, f);
+	fwrite(out->strings, 1, out->strsize, f);
+	provenance_free(out);
+
+	int err = ferror(f);
+	if (fclose(f) != 0 || err) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		free(path);
+		return -1;
+	}
+	free(path);
+	return 0;
+}
+
+/*
+ * Map the sidecar of the cache at cachepath. As with Bloom filters, a
+ * missing, malformed or stale sidecar is not an error and NULL is returned.
+ */
+struct provenance *
+provenance_open(const char *cachepath, const uuid_t uuid)
+{
+	char *path = provenance_path(cachepath);
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1)
+		return NULL;
+
+	struct stat sb;
+	struct provenance_header *hdr;
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(*hdr) ||
+			(hdr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	uint32_t count = le32toh(hdr->count), strsize = le32toh(hdr->strsize);
+	const char *strings = (const char *)hdr + sizeof(*hdr) + (size_t)count * sizeof(struct provenance_record);
+	if (memcmp(hdr->magic, PROVENANCE_MAGIC, sizeof(hdr->magic)) != 0 ||
+			le32toh(hdr->version) != PROVENANCE_VERSION ||
+			sizeof(*hdr) + (uint64_t)count * sizeof(struct provenance_record) + strsize != (uint64_t)sb.st_size ||
+			(strsize != 0 && strings[strsize - 1] != '\0') ||
+			memcmp(hdr->uuid, uuid, sizeof(uuid_t)) != 0) {
+		munmap(hdr, sb.st_size);
+		return NULL;
+	}
+
+	struct provenance *p = provenance_new();
+	p->records = (struct provenance_record *)(hdr + 1);
+	p->count = count;
+	p->strings = (char *)strings;
+	p->strsize = strsize;
+	p->map = hdr;
+	p->maplen = sb.st_size;
+
+	// Paths are only followed after this, so a corrupt offset cannot escape the map.
+	for (uint32_t i = 0; i < count; i++) {
+		if (le32toh(p->records[i].path) >= strsize) {
+			provenance_free(p);
+			return NULL;
+		}
+	}
+	return p;
+}
+
+const char *
+arch_name(uint32_t cputype, uint32_t cpusubtype)
+{
+	static char buf[32];
+
+	switch (cputype) {
+		case CPU_TYPE_X86:
+			return "i386";
+		case CPU_TYPE_X86 | CPU_ARCH_ABI64:
+			return "x86_64";
+		case CPU_TYPE_ARM:
+			return "arm";
+		case CPU_TYPE_ARM | CPU_ARCH_ABI64:
+			return (cpusubtype & ~CPU_SUBTYPE_MASK) == CPU_SUBTYPE_ARM64E ? "arm64e" : "arm64";
+		case CPU_TYPE_ARM | CPU_ARCH_ABI64_32:
+			return "arm64_32";
+	}
+	snprintf(buf, sizeof(buf), "%#x/%#x", cputype, cpusubtype);
+	return buf;
+}
@@ -32,80 +32,145 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "trustcache.h"
 #include "uuid/uuid.h"
 
+#include "compat.h"
+
 int
 tcremove(int argc, char **argv)
 {
 	bool keepuuid = false;
 	int numremoved = 0;
+	const char *errstr = NULL;
+	// Removing by path removes every cdhash the files could have been added with.
+	int walkflags = WALK_ALL_CDHASHES;
 
 	int ch;
-	while ((ch = getopt(argc, argv, "k")) != -1) {
+	while ((ch = getopt(argc, argv, "Pj:kx")) != -1) {
 		switch (ch) {
+			case 'P':
+				walkflags |= WALK_PHYSICAL;
+				break;
+			case 'j':
+				walk_jobs(strtonum(optarg, 1, 1024, &errstr));
+				if (errstr != NULL) {
+					fprintf(stderr, "job count is %s: %s\n", errstr, optarg);
+					exit(1);
+				}
+				break;
 			case 'k':
 				keepuuid = true;
 				break;
+			case 'x':
+				walkflags |= WALK_XDEV;
+				break;
 		}
 	}
 
 	argc -= optind;
 	argv += optind;
+	walk_flags(walkflags);
+	walk_reset();
 
 	if (argc < 2)
 		return -1;
 
-	FILE *f = NULL;
 	struct trust_cache cache = opentrustcache(argv[0]);
+	uuid_t olduuid;
+	uuid_copy(olduuid, cache.uuid);
 
 	if (!keepuuid)
 		uuid_generate(cache.uuid);
 
-	uint8_t hash[CS_CDHASH_LEN] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+	// Paths are also matched against the recorded origins, so files that are gone can be removed.
+	struct provenance *old = provenance_open(argv[0], olduuid);
+
+	struct hashlist doomed = {};
 
 	for (int i = 1; i < argc; i++) {
-		if (strlen(argv[i]) != 40) {
-			fprintf(stderr, "%s is not a valid CDHash\n", argv[i]);
-			exit(1);
+		if (strlen(argv[i]) == 40 && ishexstring(argv[i])) {
+			uint8_t hash[CS_CDHASH_LEN];
+			for (size_t j = 0; j < CS_CDHASH_LEN; j++)
+				sscanf(argv[i] + 2 * j, "%02hhx", &hash[j]);
+			hashlist_add(&doomed, hash);
+			continue;
 		}
-		for (size_t j = 0; j < CS_CDHASH_LEN; j++)
-			sscanf(argv[i] + 2 * j, "%02hhx", &hash[j]);
-
-		uint32_t j = 0;
-		while (j < cache.num_entries) {
-			if (cache.version == 0) {
-				if (memcmp(cache.hashes[j], hash, CS_CDHASH_LEN) == 0) {
-					memmove(&cache.hashes[j], &cache.hashes[j + 1], (cache.num_entries - j - 1) * sizeof(trust_cache_hash0));
-					cache.num_entries--;
-					numremoved++;
-					continue;
-				}
-			} else if (cache.version == 1) {
-				if (memcmp(cache.entries[j].cdhash, hash, CS_CDHASH_LEN) == 0) {
-					memmove(&cache.entries[j], &cache.entries[j + 1], (cache.num_entries - j - 1) * sizeof(struct trust_cache_entry1));
-					cache.num_entries--;
-					numremoved++;
-					continue;
-				}
-			} else if (cache.version == 2) {
-				if (memcmp(cache.entries2[j].cdhash, hash, CS_CDHASH_LEN) == 0) {
-					memmove(&cache.entries2[j], &cache.entries2[j + 1], (cache.num_entries - j - 1) * sizeof(struct trust_cache_entry2));
-					cache.num_entries--;
-					numremoved++;
-					continue;
-				}
+
+		uint32_t before = doomed.count;
+		if (old != NULL) {
+			struct tree_origin origin;
+			for (uint32_t j = 0; j < provenance_count(old); j++) {
+				provenance_get(old, j, &origin);
+				if (path_within(origin.path, argv[i]))
+					hashlist_add(&doomed, provenance_hash(old, j));
 			}
-			j++;
 		}
-		for (size_t j = 0; j < CS_CDHASH_LEN; j++)
-			hash[j] = 0;
+
+		struct stat sb;
+		if (stat(argv[i], &sb) == 0) {
+			struct trust_cache found = cache_from_tree(argv[i], 0, NULL);
+			for (uint32_t j = 0; j < found.num_entries; j++)
+				hashlist_add(&doomed, found.hashes[j]);
+			free(found.hashes);
+		} else if (doomed.count == before) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			exit(1);
+		}
+	}
+
+	/*
+	 * A single pass over the cache keeps the remaining entries in their
+	 * order. Caches written by this tool are sorted, so the sorted hashes to
+	 * remove are walked alongside it; one from elsewhere may not be, and
+	 * each of its entries is looked up instead.
+	 */
+	hashlist_sort(&doomed);
+	size_t size = entsize(cache.version);
+	uint8_t *base = (uint8_t *)cache.hashes;
+	bool sorted = true;
+	for (uint32_t i = 1; i < cache.num_entries && sorted; i++)
+		sorted = ent_cmp(base + size * (i - 1), base + size * i) <= 0;
+
+	uint32_t kept = 0, next = 0;
+	for (uint32_t i = 0; i < cache.num_entries; i++) {
+		uint8_t *ent = base + size * i;
+		bool doom;
+		if (sorted) {
+			while (next < doomed.count && hash_cmp(doomed.hashes[next], ent) < 0)
+				next++;
+			doom = next < doomed.count && hash_cmp(doomed.hashes[next], ent) == 0;
+		} else
+			doom = hashlist_has(&doomed, ent);
+		if (doom) {
+			numremoved++;
+			continue;
+		}
+		if (kept != i)
+			memcpy(base + size * kept, ent, size);
+		kept++;
 	}
+	cache.num_entries = kept;
+	hashlist_free(&doomed);
 
 	if (writetrustcache(cache, argv[0]) == -1)
 		return 1;
 
+	if (bloom_exists(argv[0]) && writebloom(cache, argv[0]) == -1)
+		return 1;
+
+	if (old != NULL) {
+		struct provenance *prov = provenance_new();
+		provenance_copy(prov, old, &cache);
+		provenance_free(old);
+		if (provenance_write(prov, cache, argv[0]) == -1)
+			return 1;
+		provenance_free(prov);
+	} else if (provenance_exists(argv[0]))
+		fprintf(stderr, "%s.paths is out of date, not updating it\n", argv[0]);
+
 	free(cache.entries);
 
 	printf("Removed %i %s\n", numremoved, numremoved == 1 ? "entry" : "entries");
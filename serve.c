@@ -0,0 +1,360 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Resident lookup server.
+ *
+ * Clients connect to a Unix domain socket and send batches of cdhashes:
+ *
+ *	uint32_t count;				// little endian, at most SERVE_MAX_BATCH
+ *	uint8_t  cdhash[count][CS_CDHASH_LEN];
+ *
+ * and receive one 4 byte answer per cdhash, in order:
+ *
+ *	uint8_t found, hash_type, flags, constraintCategory;
+ *
+ * The first cache that holds a cdhash answers for it. A background thread
+ * reloads caches whose files were replaced and publishes them as new
+ * snapshots, so caches can be regenerated and renamed into place while the
+ * server runs without stalling lookups.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "trustcache.h"
+
+#define SERVE_MAX_BATCH 65536
+#define SERVE_MAX_CLIENTS 1024
+#define SERVE_ANSWER_LEN 4
+
+struct served {
+	const char *path;
+	struct tc_published pub;
+};
+
+struct client {
+	int fd;
+	uint8_t *in;
+	size_t inlen, incap;
+	uint8_t *out;
+	size_t outlen, outoff, outcap;
+};
+
+static volatile sig_atomic_t done = 0;
+
+static void
+handle_signal(__attribute__((unused)) int sig)
+{
+	done = 1;
+}
+
+static void
+answer(struct tc_snapshot **snaps, int ncaches, const uint8_t *hash, uint8_t *out)
+{
+	memset(out, 0, SERVE_ANSWER_LEN);
+
+	for (int i = 0; i < ncaches; i++) {
+		uint8_t *ent = snapshot_search(snaps[i], hash);
+		if (ent == NULL)
+			continue;
+
+		uint32_t version = snaps[i]->cache.version;
+		out[0] = 1;
+		if (version >= 1) {
+			out[1] = ((struct trust_cache_entry1 *)ent)->hash_type;
+			out[2] = ((struct trust_cache_entry1 *)ent)->flags;
+		}
+		if (version == 2)
+			out[3] = ((struct trust_cache_entry2 *)ent)->constraintCategory;
+		return;
+	}
+}
+
+/*
+ * Check every cache for replacement once a second and publish a new
+ * snapshot when its file changed, so lookups never wait on a reload. If the
+ * new file cannot be loaded, the old snapshot stays in service.
+ */
+static void *
+reloader(void *arg)
+{
+	struct served *caches = arg;
+
+	while (!done) {
+		sleep(1);
+		for (int i = 0; caches[i].path != NULL; i++) {
+			unsigned slot;
+			struct tc_snapshot *cur = snapshot_acquire(&caches[i].pub, &slot);
+			bool stale = snapshot_stale(cur, caches[i].path);
+			snapshot_release(&caches[i].pub, slot);
+
+			struct tc_snapshot *snap;
+			if (stale && (snap = snapshot_load(caches[i].path)) != NULL)
+				snapshot_publish(&caches[i].pub, snap);
+		}
+	}
+	return NULL;
+}
+
+static void
+reserve(uint8_t **buf, size_t *cap, size_t need)
+{
+	if (need <= *cap)
+		return;
+	size_t newcap = *cap == 0 ? 4096 : *cap;
+	while (newcap < need)
+		newcap *= 2;
+	if ((*buf = realloc(*buf, newcap)) == NULL)
+		exit(1);
+	*cap = newcap;
+}
+
+/*
+ * Answer every complete request buffered for c. Returns -1 if the client
+ * sent a malformed request and should be dropped.
+ */
+static int
+process(struct client *c, struct served *caches, int ncaches)
+{
+	size_t off = 0;
+	int ret = 0;
+
+	// Hold one snapshot of each cache for the whole read.
+	struct tc_snapshot *snaps[ncaches];
+	unsigned slots[ncaches];
+	for (int i = 0; i < ncaches; i++)
+		snaps[i] = snapshot_acquire(&caches[i].pub, &slots[i]);
+
+	while (c->inlen - off >= sizeof(uint32_t)) {
+		uint32_t count;
+		memcpy(&count, c->in + off, sizeof(count));
+		count = le32toh(count);
+		if (count > SERVE_MAX_BATCH) {
+			ret = -1;
+			break;
+		}
+
+		size_t reqlen = sizeof(uint32_t) + (size_t)count * CS_CDHASH_LEN;
+		if (c->inlen - off < reqlen)
+			break;
+
+		reserve(&c->out, &c->outcap, c->outlen + (size_t)count * SERVE_ANSWER_LEN);
+		const uint8_t *hashes = c->in + off + sizeof(uint32_t);
+		for (uint32_t i = 0; i < count; i++) {
+			answer(snaps, ncaches, hashes + (size_t)i * CS_CDHASH_LEN, c->out + c->outlen);
+			c->outlen += SERVE_ANSWER_LEN;
+		}
+		off += reqlen;
+	}
+
+	for (int i = 0; i < ncaches; i++)
+		snapshot_release(&caches[i].pub, slots[i]);
+
+	memmove(c->in, c->in + off, c->inlen - off);
+	c->inlen -= off;
+	return ret;
+}
+
+static void
+drop(struct client *c)
+{
+	close(c->fd);
+	free(c->in);
+	free(c->out);
+}
+
+int
+tcserve(int argc, char **argv)
+{
+	const char *sockpath = NULL;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "s:")) != -1) {
+		switch (ch) {
+			case 's':
+				sockpath = optarg;
+				break;
+			default:
+				return -1;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 0 || sockpath == NULL)
+		return -1;
+
+	// Terminated by an entry without a path for the reloader.
+	struct served *caches = calloc(argc + 1, sizeof(struct served));
+	if (caches == NULL)
+		exit(1);
+	for (int i = 0; i < argc; i++) {
+		struct tc_snapshot *snap = snapshot_load(argv[i]);
+		if (snap == NULL)
+			return 1;
+		caches[i].path = argv[i];
+		published_init(&caches[i].pub, snap);
+	}
+
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: Socket path too long\n", sockpath);
+		return 1;
+	}
+	strcpy(addr.sun_path, sockpath);
+
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd == -1) {
+		perror("socket");
+		return 1;
+	}
+
+	// Replace a socket left behind by a previous server.
+	struct stat sb;
+	if (lstat(sockpath, &sb) == 0 && S_ISSOCK(sb.st_mode))
+		unlink(sockpath);
+
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(lfd, 128) == -1) {
+		fprintf(stderr, "%s: %s\n", sockpath, strerror(errno));
+		close(lfd);
+		return 1;
+	}
+	fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+
+	struct sigaction sa = {
+		.sa_handler = handle_signal,
+	};
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_t thread;
+	if ((errno = pthread_create(&thread, NULL, reloader, caches)) != 0) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	// Clients are kept packed, clients[i] is polled through pfds[i + 1].
+	struct client *clients = calloc(SERVE_MAX_CLIENTS, sizeof(struct client));
+	struct pollfd *pfds = calloc(SERVE_MAX_CLIENTS + 1, sizeof(struct pollfd));
+	if (clients == NULL || pfds == NULL)
+		exit(1);
+	int nclients = 0;
+
+	while (!done) {
+		pfds[0].fd = lfd;
+		pfds[0].events = POLLIN;
+		for (int i = 0; i < nclients; i++) {
+			pfds[i + 1].fd = clients[i].fd;
+			pfds[i + 1].events = clients[i].outlen > clients[i].outoff ? POLLOUT : POLLIN;
+			pfds[i + 1].revents = 0;
+		}
+
+		if (poll(pfds, nclients + 1, 1000) == -1 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		// Walk backwards so dropping a client only moves one already handled.
+		for (int i = nclients - 1; i >= 0; i--) {
+			struct client *c = &clients[i];
+			short revents = pfds[i + 1].revents;
+			bool ok = true;
+
+			if (revents & POLLOUT) {
+				ssize_t n = write(c->fd, c->out + c->outoff, c->outlen - c->outoff);
+				if (n == -1 && errno != EAGAIN && errno != EINTR)
+					ok = false;
+				if (n > 0)
+					c->outoff += n;
+			} else if (revents & (POLLIN | POLLHUP | POLLERR)) {
+				reserve(&c->in, &c->incap, c->inlen + 65536);
+				ssize_t n = read(c->fd, c->in + c->inlen, c->incap - c->inlen);
+				if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+					ok = false;
+				if (n > 0)
+					c->inlen += n;
+				if (ok && process(c, caches, argc) == -1)
+					ok = false;
+				// Try to answer right away instead of waiting for the next poll.
+				if (ok && c->outlen > 0 && (n = write(c->fd, c->out, c->outlen)) > 0)
+					c->outoff += n;
+			}
+			if (c->outoff == c->outlen)
+				c->outoff = c->outlen = 0;
+
+			if (!ok) {
+				drop(c);
+				clients[i] = clients[--nclients];
+			}
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			int fd;
+			while ((fd = accept(lfd, NULL, NULL)) != -1) {
+				if (nclients == SERVE_MAX_CLIENTS) {
+					close(fd);
+					continue;
+				}
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				memset(&clients[nclients], 0, sizeof(struct client));
+				clients[nclients++].fd = fd;
+			}
+		}
+	}
+
+	for (int i = 0; i < nclients; i++)
+		drop(&clients[i]);
+	free(clients);
+	free(pfds);
+	close(lfd);
+	unlink(sockpath);
+
+	pthread_join(thread, NULL);
+	for (int i = 0; i < argc; i++)
+		published_destroy(&caches[i].pub);
+	free(caches);
+
+	return 0;
+}
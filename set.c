@@ -0,0 +1,233 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "trustcache.h"
+
+#include "compat.h"
+
+// Fields an entry can be selected by with -s.
+enum field {
+	FIELD_HASH_TYPE,
+	FIELD_FLAGS,
+	FIELD_CATEGORY,
+	FIELD_COUNT
+};
+
+static const char *const fieldnames[FIELD_COUNT] = {
+	[FIELD_HASH_TYPE] = "hash_type",
+	[FIELD_FLAGS] = "flags",
+	[FIELD_CATEGORY] = "category",
+};
+
+// Parse field=value into the selector it names, returning false if it is not one.
+static bool
+parse_selector(const char *s, bool selected[FIELD_COUNT], uint8_t values[FIELD_COUNT])
+{
+	const char *eq = strchr(s, '=');
+	if (eq == NULL)
+		return false;
+	for (int f = 0; f < FIELD_COUNT; f++) {
+		if (strlen(fieldnames[f]) != (size_t)(eq - s) || strncmp(s, fieldnames[f], eq - s) != 0)
+			continue;
+		const char *errstr = NULL;
+		values[f] = strtonum(eq + 1, 0, UINT8_MAX, &errstr);
+		if (errstr != NULL)
+			return false;
+		selected[f] = true;
+		return true;
+	}
+	return false;
+}
+
+int
+tcset(int argc, char **argv)
+{
+	bool setflags = false, setcategory = false;
+	uint8_t flags = 0, category = 0;
+	bool selected[FIELD_COUNT] = {};
+	uint8_t values[FIELD_COUNT] = {};
+	const char *errstr = NULL;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "c:f:s:")) != -1) {
+		switch (ch) {
+			case 'c':
+				category = strtonum(optarg, 0, UINT8_MAX, &errstr);
+				if (errstr != NULL) {
+					fprintf(stderr, "category number is %s: %s\n", errstr, optarg);
+					exit(1);
+				}
+				setcategory = true;
+				break;
+			case 'f':
+				flags = strtonum(optarg, 0, UINT8_MAX, &errstr);
+				if (errstr != NULL) {
+					fprintf(stderr, "flag number is %s: %s\n", errstr, optarg);
+					exit(1);
+				}
+				setflags = true;
+				break;
+			case 's':
+				if (!parse_selector(optarg, selected, values)) {
+					fprintf(stderr, "Invalid selector %s\n", optarg);
+					exit(1);
+				}
+				break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	bool anyselected = false;
+	for (int f = 0; f < FIELD_COUNT; f++)
+		anyselected |= selected[f];
+
+	// Editing every entry of a cache has to be asked for with a selector.
+	if (argc == 0 || (!setflags && !setcategory) || (argc == 1 && !anyselected))
+		return -1;
+
+	struct mapped_cache mc;
+	if (mapcache_writable(argv[0], &mc) == -1)
+		return 1;
+	struct trust_cache cache = mc.cache;
+
+	if (cache.version == 0 || (setcategory && cache.version < 2) ||
+			(selected[FIELD_CATEGORY] && cache.version < 2)) {
+		fprintf(stderr, "%s: Version %u caches have no %s\n", argv[0], cache.version,
+				cache.version == 0 ? "flags" : "constraint categories");
+		unmapcache(&mc);
+		return 1;
+	}
+
+	/*
+	 * cdhashes given in hex are looked up in the cache. Caches written by
+	 * this tool are sorted and are searched in place; one from elsewhere may
+	 * not be, and its cdhashes are collected into a sorted list instead.
+	 */
+	size_t size = entsize(cache.version);
+	uint8_t *base = (uint8_t *)cache.hashes;
+	bool sorted = true;
+	for (uint32_t i = 1; i < cache.num_entries && sorted; i++)
+		sorted = ent_cmp(base + size * (i - 1), base + size * i) <= 0;
+	struct hashlist present = {};
+	if (!sorted) {
+		for (uint32_t i = 0; i < cache.num_entries; i++)
+			hashlist_add(&present, base + size * i);
+		hashlist_sort(&present);
+	}
+
+	struct hashlist wanted = {};
+	bool unmatched = false;
+	// Paths are only matched against the recorded origins, files are not hashed again.
+	struct provenance *prov = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strlen(argv[i]) == 40 && ishexstring(argv[i])) {
+			uint8_t hash[CS_CDHASH_LEN];
+			for (size_t j = 0; j < CS_CDHASH_LEN; j++)
+				sscanf(argv[i] + 2 * j, "%02hhx", &hash[j]);
+			if (sorted ? cache_search(&cache, NULL, hash) == NULL : !hashlist_has(&present, hash)) {
+				fprintf(stderr, "%s: No entry has this cdhash\n", argv[i]);
+				unmatched = true;
+				continue;
+			}
+			hashlist_add(&wanted, hash);
+			continue;
+		}
+
+		if (prov == NULL && (prov = provenance_open(argv[0], cache.uuid)) == NULL) {
+			fprintf(stderr, "%s.paths is missing or out of date, cannot select %s\n", argv[0], argv[i]);
+			hashlist_free(&wanted);
+			hashlist_free(&present);
+			unmapcache(&mc);
+			return 1;
+		}
+		uint32_t before = wanted.count;
+		struct tree_origin origin;
+		for (uint32_t j = 0; j < provenance_count(prov); j++) {
+			provenance_get(prov, j, &origin);
+			if (path_within(origin.path, argv[i]))
+				hashlist_add(&wanted, provenance_hash(prov, j));
+		}
+		if (wanted.count == before) {
+			fprintf(stderr, "%s: No entries recorded for this path\n", argv[i]);
+			unmatched = true;
+		}
+	}
+	provenance_free(prov);
+	hashlist_free(&present);
+	hashlist_sort(&wanted);
+
+	/*
+	 * One pass over the mapped entries, storing only the fields that
+	 * change. Cdhashes are never touched, so the cache keeps its order and
+	 * its filter and paths stay valid.
+	 */
+	uint32_t matched = 0, changed = 0;
+	for (uint32_t i = 0; i < cache.num_entries; i++) {
+		struct trust_cache_entry2 *ent = (struct trust_cache_entry2 *)(base + size * i);
+		if ((selected[FIELD_HASH_TYPE] && ent->hash_type != values[FIELD_HASH_TYPE]) ||
+				(selected[FIELD_FLAGS] && ent->flags != values[FIELD_FLAGS]) ||
+				(selected[FIELD_CATEGORY] && ent->constraintCategory != values[FIELD_CATEGORY]))
+			continue;
+		if (argc > 1 && !hashlist_has(&wanted, ent->cdhash))
+			continue;
+
+		matched++;
+		bool differs = false;
+		if (setflags && ent->flags != flags) {
+			ent->flags = flags;
+			differs = true;
+		}
+		if (setcategory && ent->constraintCategory != category) {
+			ent->constraintCategory = category;
+			differs = true;
+		}
+		changed += differs;
+	}
+	hashlist_free(&wanted);
+
+	int ret = unmatched;
+	if (changed != 0 && msync(mc.map, mc.maplen, MS_SYNC) == -1) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		ret = 1;
+	}
+	unmapcache(&mc);
+
+	printf("Updated %u of %u matching %s\n", changed, matched, matched == 1 ? "entry" : "entries");
+
+	return ret;
+}
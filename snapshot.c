@@ -0,0 +1,198 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Immutable cache snapshots published through an atomic pointer.
+ *
+ * Readers never block: they register in one of two reader counts, selected
+ * by the parity of a generation counter, and then load the current
+ * snapshot. A publisher swaps in the new snapshot, advances the generation
+ * so new readers register in the other count, and waits for the old count
+ * to drain before freeing the previous snapshot. Only publishers serialize
+ * with each other.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "trustcache.h"
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+struct tc_snapshot *
+snapshot_load(const char *path)
+{
+	struct tc_snapshot *snap = calloc(1, sizeof(struct tc_snapshot));
+	if (snap == NULL)
+		exit(1);
+
+	if (stat(path, &snap->sb) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		free(snap);
+		return NULL;
+	}
+	struct mapped_cache mc;
+	if (mapcache(path, &mc) == -1) {
+		free(snap);
+		return NULL;
+	}
+
+	/*
+	 * A private mapping still shows later writes to pages it has not
+	 * copied, and set edits caches in place, so the entries are copied
+	 * instead. Edits made after the stat above make the snapshot stale,
+	 * and it is loaded again.
+	 */
+	size_t len = entsize(mc.cache.version) * mc.cache.num_entries;
+	snap->cache = mc.cache;
+	if ((snap->cache.hashes = malloc(len == 0 ? 1 : len)) == NULL)
+		exit(1);
+	memcpy(snap->cache.hashes, mc.cache.hashes, len);
+	unmapcache(&mc);
+
+	snap->idx = index_build(&snap->cache);
+	char bloompath[PATH_MAX];
+	snprintf(bloompath, sizeof(bloompath), "%s.bloom", path);
+	if (stat(bloompath, &snap->bloomsb) == -1)
+		memset(&snap->bloomsb, 0, sizeof(snap->bloomsb));
+	snap->filter = bloom_open(path, &snap->cache);
+	return snap;
+}
+
+void
+snapshot_free(struct tc_snapshot *snap)
+{
+	if (snap == NULL)
+		return;
+	free(snap->cache.hashes);
+	index_free(snap->idx);
+	bloom_free(snap->filter);
+	free(snap);
+}
+
+static bool
+changed(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev != b->st_dev || a->st_ino != b->st_ino ||
+		a->st_size != b->st_size || a->st_mtim.tv_sec != b->st_mtim.tv_sec ||
+		a->st_mtim.tv_nsec != b->st_mtim.tv_nsec;
+}
+
+/*
+ * Returns true if the file at path, or its filter, is no longer the one
+ * snap was loaded from. The filter is written after the cache, so a
+ * snapshot loaded in between runs without one until it is reloaded. The
+ * modification time is compared to the nanosecond, so an edit made in the
+ * second the snapshot was loaded is still noticed.
+ */
+bool
+snapshot_stale(const struct tc_snapshot *snap, const char *path)
+{
+	struct stat sb;
+	if (stat(path, &sb) == -1)
+		return false;
+	if (changed(&sb, &snap->sb))
+		return true;
+
+	char bloompath[PATH_MAX];
+	snprintf(bloompath, sizeof(bloompath), "%s.bloom", path);
+	return stat(bloompath, &sb) == 0 && changed(&sb, &snap->bloomsb);
+}
+
+void *
+snapshot_search(const struct tc_snapshot *snap, const uint8_t hash[CS_CDHASH_LEN])
+{
+	if (snap->filter != NULL && !bloom_test(snap->filter, hash))
+		return NULL;
+	return cache_search(&snap->cache, snap->idx, hash);
+}
+
+void
+published_init(struct tc_published *pub, struct tc_snapshot *snap)
+{
+	atomic_init(&pub->current, snap);
+	atomic_init(&pub->generation, 0);
+	atomic_init(&pub->readers[0], 0);
+	atomic_init(&pub->readers[1], 0);
+	pthread_mutex_init(&pub->lock, NULL);
+}
+
+void
+published_destroy(struct tc_published *pub)
+{
+	snapshot_free(atomic_load(&pub->current));
+	pthread_mutex_destroy(&pub->lock);
+}
+
+struct tc_snapshot *
+snapshot_acquire(struct tc_published *pub, unsigned *slot)
+{
+	for (;;) {
+		uint64_t gen = atomic_load(&pub->generation);
+		*slot = gen & 1;
+		atomic_fetch_add(&pub->readers[*slot], 1);
+		// A publisher advanced the generation before it could see us.
+		if (atomic_load(&pub->generation) == gen)
+			break;
+		atomic_fetch_sub(&pub->readers[*slot], 1);
+	}
+	return atomic_load(&pub->current);
+}
+
+void
+snapshot_release(struct tc_published *pub, unsigned slot)
+{
+	atomic_fetch_sub(&pub->readers[slot], 1);
+}
+
+void
+snapshot_publish(struct tc_published *pub, struct tc_snapshot *snap)
+{
+	pthread_mutex_lock(&pub->lock);
+
+	struct tc_snapshot *old = atomic_exchange(&pub->current, snap);
+	uint64_t gen = atomic_fetch_add(&pub->generation, 1);
+
+	// Every reader that could still see old registered in this count.
+	struct timespec ts = { .tv_nsec = 50000 };
+	while (atomic_load(&pub->readers[gen & 1]) != 0)
+		nanosleep(&ts, NULL);
+
+	pthread_mutex_unlock(&pub->lock);
+	snapshot_free(old);
+}
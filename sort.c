@@ -25,6 +25,7 @@
  * SUCH DAMAGE.
  */
 
+#include <stdint.h>
 #include <string.h>
 
 #include "trustcache.h"
@@ -46,3 +47,22 @@ hash_cmp(const void * vp1, const void * vp2)
 
 	return memcmp(pc1, pc2, CS_CDHASH_LEN);
 }
+
+/*
+ * Drop every entry of a sorted array whose cdhash is the same as the one
+ * before it, keeping the first. Returns how many are left.
+ */
+uint32_t
+dedup_entries(void *entries, uint32_t n, size_t size)
+{
+	uint8_t *base = entries;
+	uint32_t kept = n != 0;
+	for (uint32_t i = 1; i < n; i++) {
+		if (memcmp(base + size * (kept - 1), base + size * i, CS_CDHASH_LEN) == 0)
+			continue;
+		if (kept != i)
+			memcpy(base + size * kept, base + size * i, size);
+		kept++;
+	}
+	return kept;
+}
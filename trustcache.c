@@ -25,14 +25,9 @@
  * SUCH DAMAGE.
  */
 
-#include <errno.h>
-#include <getopt.h>
-#include <limits.h>
-#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sysexits.h>
 
 #include "trustcache.h"
 
@@ -44,10 +39,19 @@ main(int argc, char **argv)
 {
 	if (argc < 2) {
 help:
-		fprintf(stderr, "Usage: trustcache append [-f flags] [-u uuid | 0] infile file ...\n"
-										"       trustcache create [-u uuid] [-v version] outfile file ...\n"
-										"       trustcache info [-c] [-h] [-e entrynum] file\n"
-										"       trustcache remove [-k] file hash ...\n\n"
+		fprintf(stderr, "Usage: trustcache append [-0FPapx] [-f flags] [-T list] [-u uuid | 0] infile file ...\n"
+										"       trustcache check [-Pax] [-j jobs] cache path ...\n"
+										"       trustcache convert [-t hash_type] [-u uuid | 0] -v version infile outfile\n"
+										"       trustcache create [-0FPapx] [-b bytes | -n entries] [-m size] [-T list] [-u uuid] [-v version] outfile file ...\n"
+										"       trustcache export [-c none | gzip | zstd] infile outfile\n"
+										"       trustcache import [-v version] infile outfile\n"
+										"       trustcache info [-chs] [-e entrynum] file\n"
+										"       trustcache lookup [-p] file hash ...\n"
+										"       trustcache remove [-Pkx] [-j jobs] file hash | path ...\n"
+										"       trustcache serve -s socket file ...\n"
+										"       trustcache set [-c category] [-f flags] [-s field=value] file [hash | path ...]\n"
+										"       trustcache verify [--fix] file\n"
+										"       trustcache watch [-F] [-d msec] [-v version] outfile file ...\n\n"
 										"See trustcache(1) for more information\n");
 		exit(1);
 	}
@@ -60,8 +64,26 @@ help:
 		ret = tccreate(argc - 1, argv + 1);
 	else if (strcmp(argv[1], "append") == 0)
 		ret = tcappend(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "check") == 0)
+		ret = tccheck(argc - 1, argv + 1);
 	else if (strcmp(argv[1], "remove") == 0)
 		ret = tcremove(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "lookup") == 0)
+		ret = tclookup(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "serve") == 0)
+		ret = tcserve(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "set") == 0)
+		ret = tcset(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "verify") == 0)
+		ret = tcverify(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "watch") == 0)
+		ret = tcwatch(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "convert") == 0)
+		ret = tcconvert(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "export") == 0)
+		ret = tcexport(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "import") == 0)
+		ret = tcimport(argc - 1, argv + 1);
 #ifdef VERSION
 	else if (strcmp(argv[1], "-v") == 0 || strcmp(argv[1], "--version") == 0)
 	    fprintf(stderr, " %s, v%s\n"
@@ -77,67 +99,3 @@ help:
 
 	return ret;
 }
-
-struct trust_cache
-opentrustcache(const char *path)
-{
-	FILE *f;
-	struct trust_cache cache;
-
-	if ((f = fopen(path, "r")) == NULL) {
-		fprintf(stderr, "%s: %s\n", path, strerror(errno));
-		exit(1);
-	}
-
-	fread(&cache, sizeof(struct trust_cache) - sizeof(struct trust_cache_entry1*), 1, f);
-	cache.version = le32toh(cache.version);
-	cache.num_entries = le32toh(cache.num_entries);
-
-	if (cache.version == 0) {
-		if ((cache.hashes = calloc(cache.num_entries, sizeof(trust_cache_hash0))) == NULL)
-			exit(EX_OSERR);
-		fread(cache.hashes, sizeof(trust_cache_hash0), cache.num_entries, f);
-	} else if (cache.version == 1) {
-		if ((cache.entries = calloc(cache.num_entries, sizeof(struct trust_cache_entry1))) == NULL)
-			exit(EX_OSERR);
-		fread(cache.entries, sizeof(struct trust_cache_entry1), cache.num_entries, f);
-	} else if (cache.version == 2) {
-		if ((cache.entries = calloc(cache.num_entries, sizeof(struct trust_cache_entry2))) == NULL)
-			exit(EX_OSERR);
-		fread(cache.entries, sizeof(struct trust_cache_entry2), cache.num_entries, f);
-	} else {
-		fprintf(stderr, "%s: Unsupported version %i\n", path, cache.version);
-		exit(1);
-	}
-
-	fclose(f);
-	return cache;
-}
-
-int
-writetrustcache(struct trust_cache cache, const char *path)
-{
-	FILE *f = NULL;
-	if ((f = fopen(path, "wb")) == NULL) {
-		fprintf(stderr, "%s: %s\n", path, strerror(errno));
-		return -1;
-	}
-
-	cache.version = htole32(cache.version);
-	cache.num_entries = htole32(cache.num_entries);
-	fwrite(&cache, sizeof(struct trust_cache) - sizeof(struct trust_cache_entry1*), 1, f);
-	cache.version = le32toh(cache.version);
-	cache.num_entries = le32toh(cache.num_entries);
-
-	for (uint32_t i = 0; i < cache.num_entries; i++) {
-		if (cache.version == 0)
-			fwrite(&cache.hashes[i], sizeof(trust_cache_hash0), 1, f);
-		else if (cache.version == 1)
-			fwrite(&cache.entries[i], sizeof(struct trust_cache_entry1), 1, f);
-		else if (cache.version == 2)
-			fwrite(&cache.entries2[i], sizeof(struct trust_cache_entry2), 1, f);
-	}
-
-	fclose(f);
-	return 0;
-}
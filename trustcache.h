@@ -1,13 +1,20 @@
 #ifndef _TRUSTCACHE_H_
 #define _TRUSTCACHE_H_
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #if __APPLE__
 #	include <libkern/OSByteOrder.h>
 #	define htole32(x) OSSwapHostToLittleInt32(x)
 #	define le32toh(x) OSSwapLittleToHostInt32(x)
+#	define htole64(x) OSSwapHostToLittleInt64(x)
+#	define le64toh(x) OSSwapLittleToHostInt64(x)
+#	define be64toh(x) OSSwapBigToHostInt64(x)
 #elif __has_include(<endian.h>)
 #	include <endian.h>
 #else
@@ -44,21 +51,176 @@ struct trust_cache {
 	};
 } __attribute__((__packed__));
 
+// a cache mapped read-only by mapcache(), or shared by mapcache_writable()
+struct mapped_cache {
+	void *map;
+	size_t maplen;
+	struct trust_cache cache;
+};
+
+// an immutable, searchable view of one cache file
+struct tc_snapshot {
+	struct stat sb;
+	// the filter's, zeroed if there was none
+	struct stat bloomsb;
+	// a copy of the entries, not a mapping of the file
+	struct trust_cache cache;
+	struct tc_index *idx;
+	struct bloom *filter;
+};
+
+// the current snapshot of a cache, swapped without blocking readers
+struct tc_published {
+	_Atomic(struct tc_snapshot *) current;
+	atomic_uint_least64_t generation;
+	atomic_uint_least64_t readers[2];
+	pthread_mutex_t lock;
+};
+
+// cdhashes collected from the command line, see hashlist.c
+struct hashlist {
+	trust_cache_hash0 *hashes;
+	uint32_t count;
+	uint32_t cap;
+};
+
+// first line of a shard manifest written by create
+#define TC_MANIFEST_MAGIC "# trustcache manifest"
+
 // flags
 #define CS_TRUST_CACHE_AMFID 0x1
 #define CS_TRUST_CACHE_ANE   0x2
 
+// size of one entry in a cache of the given version, 0 if unsupported
+static inline size_t
+entsize(uint32_t version)
+{
+	switch (version) {
+		case 0:
+			return sizeof(trust_cache_hash0);
+		case 1:
+			return sizeof(struct trust_cache_entry1);
+		case 2:
+			return sizeof(struct trust_cache_entry2);
+	}
+	return 0;
+}
+
+// The file and slice a cdhash found by walk_tree() was computed from.
+struct tree_origin {
+	const char *path;
+	uint32_t cputype;
+	uint32_t cpusubtype;
+	// Set for the other paths to a file already reported, such as hard links.
+	bool repeat;
+};
+
+/*
+ * Called by walk_tree() for each cdhash found. Only the cdhash and
+ * hash_type of the entry are filled in.
+ */
+typedef void (*tree_sink)(const struct trust_cache_entry2 *entry, const struct tree_origin *origin, void *ctx);
+
+struct extsort;
+struct bloom;
+struct tc_index;
+struct provenance;
+
 struct trust_cache opentrustcache(const char *path);
+int loadtrustcache(FILE *f, const char *path, struct trust_cache *cache);
 int writetrustcache(struct trust_cache cache, const char *path);
-struct trust_cache cache_from_tree(const char *path, uint32_t version);
+int mapcache(const char *path, struct mapped_cache *m);
+int mapcache_writable(const char *path, struct mapped_cache *m);
+void unmapcache(struct mapped_cache *m);
+struct trust_cache cache_from_tree(const char *path, uint32_t version, struct provenance *prov);
+struct trust_cache cache_from_list(FILE *list, int delim, uint32_t version, struct provenance *prov);
+int walk_tree(const char *path, tree_sink sink, void *ctx);
+int walk_list(FILE *list, int delim, tree_sink sink, void *ctx);
+void walk_jobs(int n);
+void walk_flags(int flags);
+void walk_reset(void);
+
+// Don't follow symlinks found below the paths given to walk_tree().
+#define WALK_PHYSICAL	0x1
+// Don't descend into directories on another filesystem than their root.
+#define WALK_XDEV	0x2
+// Hash every code directory of a file, not only the one the kernel would use.
+#define WALK_ALL_CDHASHES	0x4
+
+/*
+ * Called by scan_archive() for each Mach-O member with cdhashes, which the
+ * sink must copy if it keeps them.
+ */
+struct cdhashes;
+typedef void (*archive_sink)(const char *member, struct cdhashes *c, void *ctx);
+int scan_archive(const char *path, archive_sink sink, void *ctx);
+
+struct extsort *extsort_new(uint32_t version, size_t maxmem);
+void extsort_add(const struct trust_cache_entry2 *entry, const struct tree_origin *origin, void *ctx);
+int extsort_write(struct extsort *es, struct trust_cache cache, const char *path);
+void extsort_free(struct extsort *es);
+
+struct bloom *bloom_new(uint64_t n);
+void bloom_add(struct bloom *b, const uint8_t hash[CS_CDHASH_LEN]);
+bool bloom_test(const struct bloom *b, const uint8_t hash[CS_CDHASH_LEN]);
+int bloom_write(const struct bloom *b, const struct trust_cache *cache, const char *cachepath);
+struct bloom *bloom_open(const char *cachepath, const struct trust_cache *cache);
+bool bloom_exists(const char *cachepath);
+void bloom_free(struct bloom *b);
+int writebloom(struct trust_cache cache, const char *cachepath);
+
+struct provenance *provenance_new(void);
+void provenance_add(struct provenance *p, const struct trust_cache_entry2 *entry, const struct tree_origin *origin);
+void provenance_copy(struct provenance *dst, const struct provenance *src, const struct trust_cache *cache);
+int provenance_write(struct provenance *p, struct trust_cache cache, const char *cachepath);
+struct provenance *provenance_open(const char *cachepath, const uuid_t uuid);
+bool provenance_exists(const char *cachepath);
+uint32_t provenance_find(const struct provenance *p, const uint8_t hash[CS_CDHASH_LEN], uint32_t *first);
+uint32_t provenance_count(const struct provenance *p);
+const uint8_t *provenance_hash(const struct provenance *p, uint32_t i);
+uint8_t provenance_get(const struct provenance *p, uint32_t i, struct tree_origin *origin);
+void provenance_free(struct provenance *p);
+const char *arch_name(uint32_t cputype, uint32_t cpusubtype);
+
+
+struct tc_index *index_build(const struct trust_cache *cache);
+void index_free(struct tc_index *idx);
+void *cache_search(const struct trust_cache *cache, const struct tc_index *idx, const uint8_t hash[CS_CDHASH_LEN]);
+
+struct tc_snapshot *snapshot_load(const char *path);
+void snapshot_free(struct tc_snapshot *snap);
+bool snapshot_stale(const struct tc_snapshot *snap, const char *path);
+void *snapshot_search(const struct tc_snapshot *snap, const uint8_t hash[CS_CDHASH_LEN]);
+void published_init(struct tc_published *pub, struct tc_snapshot *snap);
+void published_destroy(struct tc_published *pub);
+struct tc_snapshot *snapshot_acquire(struct tc_published *pub, unsigned *slot);
+void snapshot_release(struct tc_published *pub, unsigned slot);
+void snapshot_publish(struct tc_published *pub, struct tc_snapshot *snap);
 
 int tcinfo(int argc, char **argv);
 int tccreate(int argc, char **argv);
 int tcappend(int argc, char **argv);
+int tccheck(int argc, char **argv);
 int tcremove(int argc, char **argv);
+int tcconvert(int argc, char **argv);
+int tcexport(int argc, char **argv);
+int tcimport(int argc, char **argv);
+int tclookup(int argc, char **argv);
+int tcserve(int argc, char **argv);
+int tcset(int argc, char **argv);
+int tcverify(int argc, char **argv);
+int tcwatch(int argc, char **argv);
+
+bool ishexstring(const char *s);
+bool path_within(const char *path, const char *dir);
+void hashlist_add(struct hashlist *l, const uint8_t hash[CS_CDHASH_LEN]);
+void hashlist_sort(struct hashlist *l);
+bool hashlist_has(const struct hashlist *l, const uint8_t hash[CS_CDHASH_LEN]);
+void hashlist_free(struct hashlist *l);
 
 int ent_cmp(const void * vp1, const void * vp2);
 int hash_cmp(const void * vp1, const void * vp2);
+uint32_t dedup_entries(void *entries, uint32_t n, size_t size);
 
 void print_header(struct trust_cache cache);
 void print_hash(uint8_t cdhash[CS_CDHASH_LEN], bool newline);
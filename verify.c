@@ -0,0 +1,231 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trustcache.h"
+
+// How often a problem occurs and the first entry it occurs at.
+struct problem {
+	uint32_t count;
+	uint32_t first;
+};
+
+static void
+note(struct problem *p, uint32_t i)
+{
+	if (p->count++ == 0)
+		p->first = i;
+}
+
+static void
+report(const char *path, const struct problem *p, const char *what)
+{
+	if (p->count != 0)
+		fprintf(stderr, "%s: %s: %u, the first at entry %u\n", path, what, p->count, p->first);
+}
+
+// The first 8 bytes of a cdhash as a big-endian number, which orders like memcmp.
+static inline uint64_t
+prefix(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return be64toh(v);
+}
+
+int
+tcverify(int argc, char **argv)
+{
+	bool fix = false;
+
+	static struct option longopts[] = {
+		{ "fix", no_argument, NULL, 'f' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	int ch;
+	while ((ch = getopt_long(argc, argv, "f", longopts, NULL)) != -1) {
+		switch (ch) {
+			case 'f':
+				fix = true;
+				break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		return -1;
+
+	const char *path = argv[0];
+	const size_t hdrsize = sizeof(struct trust_cache) - sizeof(struct trust_cache_entry1*);
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &sb) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return 1;
+	}
+	if ((size_t)sb.st_size < hdrsize) {
+		fprintf(stderr, "%s: Truncated trustcache header\n", path);
+		close(fd);
+		return 1;
+	}
+
+	size_t maplen = sb.st_size;
+	uint8_t *map = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	struct trust_cache cache;
+	memcpy(&cache, map, hdrsize);
+	cache.version = le32toh(cache.version);
+	cache.num_entries = le32toh(cache.num_entries);
+
+	size_t size = entsize(cache.version);
+	if (size == 0) {
+		fprintf(stderr, "%s: Unsupported version %i\n", path, cache.version);
+		munmap(map, maplen);
+		return 1;
+	}
+
+	// The size of the file must match the entry count in the header.
+	bool sizebad = false;
+	uint32_t n = cache.num_entries;
+	size_t present = (maplen - hdrsize) / size;
+	if (present < n) {
+		fprintf(stderr, "%s: Truncated trustcache, expected %u entries but found %zu\n", path, n, present);
+		n = present;
+		sizebad = true;
+	} else if (maplen - hdrsize != (size_t)n * size) {
+		fprintf(stderr, "%s: %zu bytes past the last entry\n", path, maplen - hdrsize - (size_t)n * size);
+		sizebad = true;
+	}
+
+	/*
+	 * One pass over adjacent pairs. Distinct cdhashes almost always differ
+	 * in their first 8 bytes, so a single 64-bit compare orders most pairs
+	 * and memcmp(3) is left for the rest.
+	 */
+	struct problem unsorted = {}, duplicate = {}, hashtype = {};
+	const uint8_t *entries = map + hdrsize;
+	uint64_t last = n != 0 ? prefix(entries) : 0;
+	for (uint32_t i = 0; i < n; i++) {
+		const uint8_t *ent = entries + size * i;
+		if (cache.version != 0) {
+			uint8_t type = ent[offsetof(struct trust_cache_entry1, hash_type)];
+			if (type < CS_HASHTYPE_SHA1 || type > CS_HASHTYPE_SHA384)
+				note(&hashtype, i);
+		}
+		if (i == 0)
+			continue;
+
+		uint64_t cur = prefix(ent);
+		int cmp = last < cur ? -1 : last > cur ? 1 : memcmp(ent - size, ent, CS_CDHASH_LEN);
+		if (cmp > 0)
+			note(&unsorted, i);
+		else if (cmp == 0)
+			note(&duplicate, i);
+		last = cur;
+	}
+
+	report(path, &unsorted, "entries out of order");
+	report(path, &duplicate, "duplicate entries");
+	report(path, &hashtype, "entries with an invalid hash type");
+
+	bool fixable = sizebad || unsorted.count != 0 || duplicate.count != 0;
+	if (!fix || !fixable) {
+		munmap(map, maplen);
+		return fixable || hashtype.count != 0;
+	}
+
+	// Keep the entries that are there, sorted and each only once.
+	if ((cache.hashes = malloc(n == 0 ? 1 : size * n)) == NULL)
+		exit(1);
+	memcpy(cache.hashes, entries, size * n);
+	munmap(map, maplen);
+
+	if (unsorted.count != 0)
+		qsort(cache.hashes, n, size, ent_cmp);
+	uint32_t kept = dedup_entries(cache.hashes, n, size);
+	cache.num_entries = kept;
+
+	/*
+	 * Only unreadable and repeated entries are gone, so the uuid and the
+	 * sidecars tagged with it still hold. Write into a temporary file next
+	 * to the cache and rename it into place, so a failed write leaves the
+	 * cache as it was.
+	 */
+	size_t tmplen = strlen(path) + sizeof(".XXXXXX");
+	char *tmppath = malloc(tmplen);
+	if (tmppath == NULL)
+		exit(1);
+	snprintf(tmppath, tmplen, "%s.XXXXXX", path);
+	mode_t mask = umask(0);
+	umask(mask);
+
+	int ret = 0;
+	int tmpfd = mkstemp(tmppath);
+	if (tmpfd == -1 || fchmod(tmpfd, 0666 & ~mask) == -1) {
+		fprintf(stderr, "%s: %s\n", tmppath, strerror(errno));
+		ret = 1;
+	} else if (writetrustcache(cache, tmppath) == -1) {
+		ret = 1;
+	} else if (rename(tmppath, path) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		ret = 1;
+	}
+	if (tmpfd != -1)
+		close(tmpfd);
+	if (ret != 0 && tmpfd != -1)
+		unlink(tmppath);
+	if (ret == 0)
+		printf("Fixed %s, %u entries\n", path, kept);
+	free(tmppath);
+	free(cache.hashes);
+
+	// A hash type cannot be guessed, so those entries are left for the user.
+	return ret || hashtype.count != 0;
+}
@@ -0,0 +1,743 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2022 Cameron Katri.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY CAMERON KATRI AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL CAMERON KATRI OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Keep a cache up to date with the trees it was made from.
+ *
+ * Every regular file under the watched paths is remembered along with its
+ * inode, size and modification time and the cdhashes found in it. inotify
+ * reports the names that were created, written, moved or deleted; once the
+ * trees have been quiet for the debounce delay only those names are stat'd
+ * and, if they changed, hashed again. The cdhashes of every remembered
+ * file are kept sorted; the ones added and dropped since the last flush are
+ * merged into them in one pass, and the cache is rewritten from them and
+ * renamed into place. A directory that appears is scanned and watched, one
+ * that disappears retires everything below it.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trustcache.h"
+
+#include "compat.h"
+
+#ifdef __linux__
+
+#include <ftw.h>
+#include <limits.h>
+#include <poll.h>
+#include <search.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "machoparse/cdhash.h"
+#include "uuid/uuid.h"
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+		IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF)
+
+// Flush no later than this many debounce delays after the first change.
+#define WATCH_MAX_DELAYS 10
+
+struct wdir;
+
+struct watched {
+	char *path;
+	struct wdir *dir;
+	size_t slot;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	uint64_t scan;
+	// Only the slices found are kept, most files having none.
+	int count;
+	struct hashes *h;
+};
+
+// A directory holding remembered files, so a subtree can be retired or swept.
+struct wdir {
+	char *path;
+	struct wdir *parent;
+	size_t slot;
+	int wd;
+	uint64_t scan;
+	struct watched **files;
+	size_t nfiles, filescap;
+	struct wdir **subs;
+	size_t nsubs, subscap;
+};
+
+static volatile sig_atomic_t done = 0;
+
+static int ifd = -1;
+
+// Every remembered file, a tsearch(3) tree of struct watched ordered by path.
+static void *files = NULL;
+static uint64_t scan = 0;
+
+/*
+ * The cdhashes of every remembered file in ent_cmp() order, each as many
+ * times as there are files holding it, so dropping one file's cdhashes
+ * leaves those of its copies. Entries are entsize(version) bytes.
+ */
+static uint8_t *entries = NULL;
+static uint32_t nentries = 0;
+
+// cdhashes added and dropped since the last flush.
+struct delta {
+	struct trust_cache_entry2 *ents;
+	size_t count, cap;
+};
+static struct delta added = {}, dropped = {};
+
+// Every directory above a remembered file, a tsearch(3) tree of struct wdir.
+static void *wdirs = NULL;
+
+// Watched paths, indexed by watch descriptor.
+static char **dirs = NULL;
+static int ndirs = 0;
+
+// The paths given on the command line.
+static char **roots = NULL;
+static int nroots = 0;
+
+// Names reported since the last flush.
+static char **pending = NULL;
+static size_t npending = 0, pendingcap = 0;
+
+static void
+handle_signal(__attribute__((unused)) int sig)
+{
+	done = 1;
+}
+
+static int
+watched_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct watched *)a)->path, ((const struct watched *)b)->path);
+}
+
+static int
+wdir_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct wdir *)a)->path, ((const struct wdir *)b)->path);
+}
+
+static int
+pending_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void
+delta_add(struct delta *d, const struct hashes *h, int count)
+{
+	for (int i = 0; i < count; i++) {
+		if (d->count == d->cap) {
+			d->cap = d->cap == 0 ? 64 : d->cap * 2;
+			if ((d->ents = realloc(d->ents, d->cap * sizeof(*d->ents))) == NULL)
+				exit(1);
+		}
+		struct trust_cache_entry2 *ent = &d->ents[d->count++];
+		memset(ent, 0, sizeof(*ent));
+		ent->hash_type = h[i].hash_type;
+		memcpy(ent->cdhash, h[i].cdhash, CS_CDHASH_LEN);
+	}
+}
+
+static int
+watch_path(const char *path)
+{
+	int wd = inotify_add_watch(ifd, path, WATCH_EVENTS);
+	if (wd == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (wd >= ndirs) {
+		int n = ndirs == 0 ? 64 : ndirs;
+		while (n <= wd)
+			n *= 2;
+		if ((dirs = realloc(dirs, n * sizeof(*dirs))) == NULL)
+			exit(1);
+		memset(dirs + ndirs, 0, (n - ndirs) * sizeof(*dirs));
+		ndirs = n;
+	}
+	free(dirs[wd]);
+	if ((dirs[wd] = strdup(path)) == NULL)
+		exit(1);
+	return wd;
+}
+
+static struct wdir *
+find_dir(const char *path)
+{
+	struct wdir key = { .path = (char *)path };
+	void *node = tfind(&key, &wdirs, wdir_cmp);
+	return node == NULL ? NULL : *(struct wdir **)node;
+}
+
+static struct watched *
+find_file(const char *path)
+{
+	struct watched key = { .path = (char *)path };
+	void *node = tfind(&key, &files, watched_cmp);
+	return node == NULL ? NULL : *(struct watched **)node;
+}
+
+// The directory path is in, or NULL at the top of a relative or absolute path.
+static char *
+parent_path(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL || (slash == path && path[1] == '\0'))
+		return NULL;
+	char *up = strndup(path, slash == path ? 1 : (size_t)(slash - path));
+	if (up == NULL)
+		exit(1);
+	return up;
+}
+
+// The directory remembered for path, made along with those above it.
+static struct wdir *
+get_dir(const char *path)
+{
+	struct wdir *d = find_dir(path);
+	if (d != NULL)
+		return d;
+
+	if ((d = calloc(1, sizeof(*d))) == NULL || (d->path = strdup(path)) == NULL ||
+			tsearch(d, &wdirs, wdir_cmp) == NULL)
+		exit(1);
+	d->wd = -1;
+
+	char *up = parent_path(path);
+	if (up == NULL)
+		return d;
+	d->parent = get_dir(up);
+	free(up);
+
+	struct wdir *p = d->parent;
+	if (p->nsubs == p->subscap) {
+		p->subscap = p->subscap == 0 ? 8 : p->subscap * 2;
+		if ((p->subs = realloc(p->subs, p->subscap * sizeof(*p->subs))) == NULL)
+			exit(1);
+	}
+	d->slot = p->nsubs;
+	p->subs[p->nsubs++] = d;
+	return d;
+}
+
+static void
+forget(struct watched *w)
+{
+	struct wdir *d = w->dir;
+	d->files[w->slot] = d->files[--d->nfiles];
+	d->files[w->slot]->slot = w->slot;
+
+	tdelete(w, &files, watched_cmp);
+	delta_add(&dropped, w->h, w->count);
+	free(w->h);
+	free(w->path);
+	free(w);
+}
+
+// Forget a directory and everything below it, and stop watching it.
+static void
+retire(struct wdir *d)
+{
+	while (d->nfiles != 0)
+		forget(d->files[d->nfiles - 1]);
+	while (d->nsubs != 0)
+		retire(d->subs[d->nsubs - 1]);
+
+	if (d->wd != -1 && d->wd < ndirs && dirs[d->wd] != NULL && strcmp(dirs[d->wd], d->path) == 0) {
+		inotify_rm_watch(ifd, d->wd);
+		free(dirs[d->wd]);
+		dirs[d->wd] = NULL;
+	}
+	if (d->parent != NULL) {
+		struct wdir *p = d->parent;
+		p->subs[d->slot] = p->subs[--p->nsubs];
+		p->subs[d->slot]->slot = d->slot;
+	}
+
+	tdelete(d, &wdirs, wdir_cmp);
+	free(d->files);
+	free(d->subs);
+	free(d->path);
+	free(d);
+}
+
+// Forget whatever below d the current scan did not reach.
+static void
+sweep(struct wdir *d)
+{
+	for (size_t i = d->nfiles; i-- > 0; )
+		if (d->files[i]->scan != scan)
+			forget(d->files[i]);
+	for (size_t i = d->nsubs; i-- > 0; ) {
+		if (d->subs[i]->scan != scan)
+			retire(d->subs[i]);
+		else
+			sweep(d->subs[i]);
+	}
+}
+
+// Remember a regular file, hashing it only if it is new or was changed.
+static void
+update_file(const char *path, const struct stat *sb)
+{
+	struct watched key = { .path = (char *)path }, *w;
+	void *node = tfind(&key, &files, watched_cmp);
+
+	if (node != NULL) {
+		w = *(struct watched **)node;
+		w->scan = scan;
+		if (w->dev == sb->st_dev && w->ino == sb->st_ino && w->size == sb->st_size &&
+				w->mtime.tv_sec == sb->st_mtim.tv_sec && w->mtime.tv_nsec == sb->st_mtim.tv_nsec)
+			return;
+		delta_add(&dropped, w->h, w->count);
+		free(w->h);
+	} else {
+		if ((w = calloc(1, sizeof(*w))) == NULL || (w->path = strdup(path)) == NULL ||
+				tsearch(w, &files, watched_cmp) == NULL)
+			exit(1);
+		w->scan = scan;
+
+		char *up = parent_path(path);
+		struct wdir *d = w->dir = get_dir(up != NULL ? up : ".");
+		free(up);
+		if (d->nfiles == d->filescap) {
+			d->filescap = d->filescap == 0 ? 8 : d->filescap * 2;
+			if ((d->files = realloc(d->files, d->filescap * sizeof(*d->files))) == NULL)
+				exit(1);
+		}
+		w->slot = d->nfiles;
+		d->files[d->nfiles++] = w;
+	}
+
+	w->dev = sb->st_dev;
+	w->ino = sb->st_ino;
+	w->size = sb->st_size;
+	w->mtime = sb->st_mtim;
+	w->count = 0;
+	w->h = NULL;
+
+	struct cdhashes c = {};
+	find_cdhash(path, sb, &c);
+	if (c.count != 0) {
+		if ((w->h = malloc(c.count * sizeof(struct hashes))) == NULL)
+			exit(1);
+		memcpy(w->h, c.h, c.count * sizeof(struct hashes));
+		w->count = c.count;
+		delta_add(&added, w->h, w->count);
+	}
+}
+
+static int
+scan_callback(const char *path, const struct stat *sb, int typeflag, __attribute__((unused)) struct FTW *ftw)
+{
+	if (typeflag == FTW_D) {
+		struct wdir *d = get_dir(path);
+		d->scan = scan;
+		d->wd = watch_path(path);
+	} else if (typeflag == FTW_F && S_ISREG(sb->st_mode))
+		update_file(path, sb);
+	return 0;
+}
+
+/*
+ * Bring everything at and below path up to date: walk whatever is there now,
+ * then forget the remembered files below it the walk did not reach. A path
+ * that is gone, or changed between file and directory, has what was
+ * remembered for it retired directly.
+ */
+static void
+rescan(const char *path)
+{
+	struct stat sb;
+	bool isdir = false, isreg = false;
+	struct watched *w;
+	struct wdir *d;
+
+	scan++;
+	if (stat(path, &sb) == 0) {
+		isdir = S_ISDIR(sb.st_mode);
+		isreg = S_ISREG(sb.st_mode);
+	}
+	if (!isreg && (w = find_file(path)) != NULL)
+		forget(w);
+	if (!isdir && (d = find_dir(path)) != NULL)
+		retire(d);
+
+	if (isreg)
+		update_file(path, &sb);
+	else if (isdir) {
+		nftw(path, scan_callback, 20, 0);
+		if ((d = find_dir(path)) != NULL)
+			sweep(d);
+	}
+}
+
+// Stop watching path and the directories below it.
+static void
+unwatch(const char *path)
+{
+	for (int wd = 0; wd < ndirs; wd++) {
+		if (dirs[wd] != NULL && path_within(dirs[wd], path)) {
+			inotify_rm_watch(ifd, wd);
+			free(dirs[wd]);
+			dirs[wd] = NULL;
+		}
+	}
+}
+
+static void
+add_pending(const char *dir, const char *name)
+{
+	if (npending == pendingcap) {
+		pendingcap = pendingcap == 0 ? 64 : pendingcap * 2;
+		if ((pending = realloc(pending, pendingcap * sizeof(*pending))) == NULL)
+			exit(1);
+	}
+
+	size_t len = strlen(dir) + strlen(name) + 2;
+	if ((pending[npending] = malloc(len)) == NULL)
+		exit(1);
+	if (*name == '\0')
+		snprintf(pending[npending], len, "%s", dir);
+	else
+		snprintf(pending[npending], len, "%s/%s", dir, name);
+	npending++;
+}
+
+/*
+ * Handle every name reported since the last flush. Names that are gone are
+ * handled first, so a directory renamed within a watched tree is unwatched
+ * under its old name before it is watched again under its new one.
+ */
+static void
+process_pending(void)
+{
+	qsort(pending, npending, sizeof(*pending), pending_cmp);
+
+	struct stat sb;
+	for (size_t i = 0; i < npending; i++) {
+		if ((i > 0 && strcmp(pending[i], pending[i - 1]) == 0) || stat(pending[i], &sb) == 0)
+			continue;
+		// Directories are unwatched as they are retired, a file given on
+		// the command line is not remembered as one.
+		for (int j = 0; j < nroots; j++)
+			if (strcmp(pending[i], roots[j]) == 0)
+				unwatch(pending[i]);
+		rescan(pending[i]);
+	}
+	for (size_t i = 0; i < npending; i++) {
+		if ((i > 0 && strcmp(pending[i], pending[i - 1]) == 0) || stat(pending[i], &sb) == -1)
+			continue;
+		// A file given on the command line that was replaced has lost its watch.
+		if (!S_ISDIR(sb.st_mode))
+			for (int j = 0; j < nroots; j++)
+				if (strcmp(pending[i], roots[j]) == 0)
+					watch_path(pending[i]);
+		rescan(pending[i]);
+	}
+
+	for (size_t i = 0; i < npending; i++)
+		free(pending[i]);
+	npending = 0;
+}
+
+/*
+ * Merge the cdhashes added since the last flush into the sorted ones and
+ * drop those of files that changed or are gone, in one pass. Each dropped
+ * cdhash takes one copy of itself with it, whether that was remembered
+ * before or was added since.
+ */
+static int
+merge(size_t size)
+{
+	size_t total = nentries + added.count;
+	if (total > UINT32_MAX)
+		return -1;
+
+	qsort(added.ents, added.count, sizeof(*added.ents), ent_cmp);
+	qsort(dropped.ents, dropped.count, sizeof(*dropped.ents), ent_cmp);
+	uint8_t *merged = malloc(total == 0 ? 1 : size * total);
+	if (merged == NULL)
+		exit(1);
+
+	uint32_t i = 0, n = 0;
+	size_t j = 0, k = 0;
+	while (i < nentries || j < added.count) {
+		const void *ent;
+		if (j == added.count || (i < nentries && ent_cmp(entries + size * i, &added.ents[j]) <= 0))
+			ent = entries + size * i++;
+		else
+			ent = &added.ents[j++];
+
+		while (k < dropped.count && ent_cmp(&dropped.ents[k], ent) < 0)
+			k++;
+		if (k < dropped.count && ent_cmp(&dropped.ents[k], ent) == 0) {
+			k++;
+			continue;
+		}
+		memcpy(merged + size * n++, ent, size);
+	}
+
+	free(entries);
+	entries = merged;
+	nentries = n;
+	added.count = dropped.count = 0;
+	return 0;
+}
+
+/*
+ * Write every remembered cdhash, sorted and with those found in more than
+ * one file (such as hard links) written once, to a temporary file that is
+ * synced and renamed over path. The filter, if any, is written first so it
+ * is in place when the cache appears. The old cache is left alone if any
+ * step fails.
+ */
+static int
+flush(const char *path, uint32_t version, bool filter)
+{
+	size_t size = entsize(version);
+	if (merge(size) == -1) {
+		fprintf(stderr, "%s: Too many entries\n", path);
+		return -1;
+	}
+
+	struct trust_cache cache = {
+		.version = version,
+	};
+	uuid_generate(cache.uuid);
+	if ((cache.hashes = malloc(nentries == 0 ? 1 : size * nentries)) == NULL)
+		exit(1);
+	memcpy(cache.hashes, entries, size * nentries);
+	cache.num_entries = dedup_entries(cache.hashes, nentries, size);
+
+	size_t tmplen = strlen(path) + sizeof(".XXXXXX");
+	char *tmppath = malloc(tmplen);
+	if (tmppath == NULL)
+		exit(1);
+	snprintf(tmppath, tmplen, "%s.XXXXXX", path);
+	mode_t mask = umask(0);
+	umask(mask);
+
+	int ret = 0;
+	int fd = mkstemp(tmppath);
+	if (fd == -1 || fchmod(fd, 0666 & ~mask) == -1) {
+		fprintf(stderr, "%s: %s\n", tmppath, strerror(errno));
+		ret = -1;
+	} else if (writetrustcache(cache, tmppath) == -1) {
+		ret = -1;
+	} else if (fsync(fd) == -1) {
+		// The cache is written through its own stream, but fsync(2)
+		// flushes the file through any descriptor open on it.
+		fprintf(stderr, "%s: %s\n", tmppath, strerror(errno));
+		ret = -1;
+	} else if (filter && writebloom(cache, path) == -1) {
+		ret = -1;
+	} else if (rename(tmppath, path) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		ret = -1;
+	}
+	if (fd != -1)
+		close(fd);
+	if (ret == -1 && fd != -1)
+		unlink(tmppath);
+
+	free(tmppath);
+	free(cache.hashes);
+	return ret;
+}
+
+static long long
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+tcwatch(int argc, char **argv)
+{
+	uint32_t version = 1;
+	long long delay = 500;
+	bool filter = false;
+	const char *errstr = NULL;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "Fd:v:")) != -1) {
+		switch (ch) {
+			case 'F':
+				filter = true;
+				break;
+			case 'd':
+				delay = strtonum(optarg, 0, 3600000, &errstr);
+				if (errstr != NULL) {
+					fprintf(stderr, "delay is %s: %s\n", errstr, optarg);
+					exit(1);
+				}
+				break;
+			case 'v':
+				if (strlen(optarg) != 1 || (optarg[0] != '0' && optarg[0] != '1' && optarg[0] != '2')) {
+					fprintf(stderr, "Unsupported trustcache version %s\n", optarg);
+					return 1;
+				}
+				version = optarg[0] - '0';
+				break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 2)
+		return -1;
+
+	if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		perror("inotify_init1");
+		return 1;
+	}
+
+	struct sigaction sa = {
+		.sa_handler = handle_signal,
+	};
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	roots = argv + 1;
+	nroots = argc - 1;
+	for (int i = 1; i < argc; i++) {
+		struct stat sb;
+		if (stat(argv[i], &sb) == -1) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			return 1;
+		}
+		// nftw(3) watches directories itself, a file is watched directly.
+		if (!S_ISDIR(sb.st_mode))
+			watch_path(argv[i]);
+		rescan(argv[i]);
+	}
+	if (flush(argv[0], version, filter) == -1)
+		return 1;
+
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+	long long first = 0, last = 0;
+	int ret = 0;
+
+	while (!done) {
+		int timeout = -1;
+		if (npending != 0) {
+			long long deadline = last + delay;
+			if (deadline > first + delay * WATCH_MAX_DELAYS)
+				deadline = first + delay * WATCH_MAX_DELAYS;
+			timeout = deadline - now_ms();
+			if (timeout < 0)
+				timeout = 0;
+		}
+
+		struct pollfd pfd = { .fd = ifd, .events = POLLIN };
+		int n = poll(&pfd, 1, timeout);
+		if (n == -1 && errno != EINTR) {
+			perror("poll");
+			ret = 1;
+			break;
+		}
+
+		if (n > 0) {
+			ssize_t len;
+			while ((len = read(ifd, buf, sizeof(buf))) > 0) {
+				size_t before = npending;
+				for (char *p = buf; p < buf + len; ) {
+					struct inotify_event *ev = (struct inotify_event *)p;
+					p += sizeof(*ev) + ev->len;
+
+					if (ev->mask & IN_Q_OVERFLOW) {
+						// Events were lost, every tree has to be walked.
+						for (int i = 0; i < nroots; i++)
+							add_pending(roots[i], "");
+					} else if (ev->mask & IN_IGNORED) {
+						if (ev->wd < ndirs) {
+							free(dirs[ev->wd]);
+							dirs[ev->wd] = NULL;
+						}
+					} else if (ev->wd < ndirs && dirs[ev->wd] != NULL)
+						add_pending(dirs[ev->wd], ev->len != 0 ? ev->name : "");
+				}
+				if (npending != before) {
+					last = now_ms();
+					if (before == 0)
+						first = last;
+				}
+			}
+			continue;
+		}
+
+		if (npending != 0) {
+			process_pending();
+			if ((added.count != 0 || dropped.count != 0) && flush(argv[0], version, filter) == -1)
+				ret = 1;
+		}
+	}
+
+	// Do not drop changes that were still being debounced.
+	if (npending != 0) {
+		process_pending();
+		if ((added.count != 0 || dropped.count != 0) && flush(argv[0], version, filter) == -1)
+			ret = 1;
+	}
+
+	close(ifd);
+	return ret;
+}
+
+#else
+
+int
+tcwatch(__attribute__((unused)) int argc, __attribute__((unused)) char **argv)
+{
+	fprintf(stderr, "watch is only supported on Linux\n");
+	return 1;
+}
+
+#endif